@@ -0,0 +1,51 @@
+/*
+ * QEMU inference backend interface
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "sysemu/inference-backend.h"
+
+int inference_backend_submit(InferenceBackend *backend, InferenceRequest *req,
+                             Error **errp)
+{
+    InferenceBackendClass *ibc = INFERENCE_BACKEND_GET_CLASS(backend);
+
+    req->submit_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    return ibc->submit(backend, req, errp);
+}
+
+int inference_backend_poll(InferenceBackend *backend, InferenceRequest *req,
+                           int64_t timeout_ns)
+{
+    InferenceBackendClass *ibc = INFERENCE_BACKEND_GET_CLASS(backend);
+
+    return ibc->poll(backend, req, timeout_ns);
+}
+
+void inference_backend_cancel(InferenceBackend *backend,
+                              InferenceRequest *req)
+{
+    InferenceBackendClass *ibc = INFERENCE_BACKEND_GET_CLASS(backend);
+
+    if (ibc->cancel) {
+        ibc->cancel(backend, req);
+    }
+}
+
+static const TypeInfo inference_backend_info = {
+    .name = TYPE_INFERENCE_BACKEND,
+    .parent = TYPE_INTERFACE,
+    .class_size = sizeof(InferenceBackendClass),
+};
+
+static void register_types(void)
+{
+    type_register_static(&inference_backend_info);
+}
+
+type_init(register_types);
@@ -0,0 +1,430 @@
+/*
+ * Compute kernels of the CPU inference backend
+ *
+ * Single precision GEMM and activation kernels in portable C and, when
+ * the compiler supports them, with AVX2 and AVX-512F intrinsics. The
+ * vector kernels fall back to C for the tail that does not fill a vector.
+ * They are kept apart from the backend so that tests can check each set
+ * against the C one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "sysemu/inference-cpu.h"
+#include "host/cpuinfo.h"
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include <immintrin.h>
+#endif
+
+/* sqrt(2 / pi), for the tanh approximation of GELU */
+#define GELU_SCALE 0.7978845608f
+#define GELU_CUBIC 0.044715f
+
+static void gemm_c(size_t m, size_t k, size_t n,
+                   const float *a, const float *b, float *c)
+{
+    memset(c, 0, m * n * sizeof(float));
+    for (size_t i = 0; i < m; i++) {
+        for (size_t p = 0; p < k; p++) {
+            float s = a[i * k + p];
+
+            for (size_t j = 0; j < n; j++) {
+                c[i * n + j] += s * b[p * n + j];
+            }
+        }
+    }
+}
+
+static void relu_c(size_t n, const float *x, float *y)
+{
+    for (size_t i = 0; i < n; i++) {
+        y[i] = x[i] > 0.0f ? x[i] : 0.0f;
+    }
+}
+
+static void gelu_c(size_t n, const float *x, float *y)
+{
+    for (size_t i = 0; i < n; i++) {
+        float v = x[i];
+
+        y[i] = 0.5f * v * (1.0f + tanhf(GELU_SCALE *
+                                        (v + GELU_CUBIC * v * v * v)));
+    }
+}
+
+static void softmax_c(size_t n, const float *x, float *y)
+{
+    float max = -INFINITY, sum = 0.0f;
+
+    for (size_t i = 0; i < n; i++) {
+        max = MAX(max, x[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        y[i] = expf(x[i] - max);
+        sum += y[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        y[i] /= sum;
+    }
+}
+
+static const InferenceCpuKernels kernels_c = {
+    .name = "c",
+    .gemm = gemm_c,
+    .relu = relu_c,
+    .gelu = gelu_c,
+    .softmax = softmax_c,
+};
+
+/*
+ * Vector exp() for the x86 kernels: range reduction to 2^n * e^r with
+ * |r| <= ln(2) / 2 and a degree 5 polynomial for e^r, as in Cephes expf.
+ */
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -88.3762626647949f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+#ifdef CONFIG_AVX2_OPT
+static inline __m256 __attribute__((target("avx2")))
+exp_avx2(__m256 x)
+{
+    __m256 fx, y, z;
+    __m256i n;
+
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)),
+                      _mm256_set1_ps(EXP_HI));
+    fx = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x,
+                                          _mm256_set1_ps(EXP_LOG2E)),
+                                       _mm256_set1_ps(0.5f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(EXP_C1)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(EXP_C2)));
+
+    y = _mm256_set1_ps(EXP_P0);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(EXP_P1));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(EXP_P2));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(EXP_P3));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(EXP_P4));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(EXP_P5));
+    z = _mm256_mul_ps(x, x);
+    y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), x),
+                      _mm256_set1_ps(1.0f));
+
+    n = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127));
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(n, 23)));
+}
+
+static float __attribute__((target("avx2")))
+hsum_avx2(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+static float __attribute__((target("avx2")))
+hmax_avx2(__m256 v)
+{
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_max_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+static void __attribute__((target("avx2")))
+gemm_avx2(size_t m, size_t k, size_t n,
+          const float *a, const float *b, float *c)
+{
+    size_t nv = QEMU_ALIGN_DOWN(n, 8);
+
+    memset(c, 0, m * n * sizeof(float));
+    for (size_t i = 0; i < m; i++) {
+        float *ci = c + i * n;
+
+        for (size_t p = 0; p < k; p++) {
+            const float *bp = b + p * n;
+            float s = a[i * k + p];
+            __m256 vs = _mm256_set1_ps(s);
+            size_t j;
+
+            for (j = 0; j < nv; j += 8) {
+                __m256 acc = _mm256_loadu_ps(ci + j);
+
+                acc = _mm256_add_ps(acc,
+                                    _mm256_mul_ps(vs, _mm256_loadu_ps(bp + j)));
+                _mm256_storeu_ps(ci + j, acc);
+            }
+            for (; j < n; j++) {
+                ci[j] += s * bp[j];
+            }
+        }
+    }
+}
+
+static void __attribute__((target("avx2")))
+relu_avx2(size_t n, const float *x, float *y)
+{
+    size_t nv = QEMU_ALIGN_DOWN(n, 8);
+    __m256 zero = _mm256_setzero_ps();
+    size_t i;
+
+    for (i = 0; i < nv; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_max_ps(_mm256_loadu_ps(x + i), zero));
+    }
+    relu_c(n - i, x + i, y + i);
+}
+
+static void __attribute__((target("avx2")))
+gelu_avx2(size_t n, const float *x, float *y)
+{
+    size_t nv = QEMU_ALIGN_DOWN(n, 8);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 two = _mm256_set1_ps(2.0f);
+    size_t i;
+
+    for (i = 0; i < nv; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        __m256 v3 = _mm256_mul_ps(_mm256_mul_ps(v, v), v);
+        __m256 z, t;
+
+        z = _mm256_mul_ps(_mm256_set1_ps(GELU_SCALE),
+                          _mm256_add_ps(v, _mm256_mul_ps(
+                                            _mm256_set1_ps(GELU_CUBIC), v3)));
+        /* tanh(z) = 1 - 2 / (e^2z + 1) */
+        t = _mm256_sub_ps(one, _mm256_div_ps(two, _mm256_add_ps(
+                                   exp_avx2(_mm256_mul_ps(two, z)), one)));
+        _mm256_storeu_ps(y + i, _mm256_mul_ps(_mm256_mul_ps(
+                                    _mm256_set1_ps(0.5f), v),
+                                    _mm256_add_ps(one, t)));
+    }
+    gelu_c(n - i, x + i, y + i);
+}
+
+static void __attribute__((target("avx2")))
+softmax_avx2(size_t n, const float *x, float *y)
+{
+    size_t nv = QEMU_ALIGN_DOWN(n, 8);
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    __m256 vsum = _mm256_setzero_ps();
+    float max, sum;
+    size_t i;
+
+    for (i = 0; i < nv; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
+    }
+    max = hmax_avx2(vmax);
+    for (; i < n; i++) {
+        max = MAX(max, x[i]);
+    }
+
+    for (i = 0; i < nv; i += 8) {
+        __m256 e = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i),
+                                          _mm256_set1_ps(max)));
+
+        _mm256_storeu_ps(y + i, e);
+        vsum = _mm256_add_ps(vsum, e);
+    }
+    sum = hsum_avx2(vsum);
+    for (; i < n; i++) {
+        y[i] = expf(x[i] - max);
+        sum += y[i];
+    }
+
+    vsum = _mm256_set1_ps(1.0f / sum);
+    for (i = 0; i < nv; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_mul_ps(_mm256_loadu_ps(y + i), vsum));
+    }
+    for (; i < n; i++) {
+        y[i] /= sum;
+    }
+}
+
+static const InferenceCpuKernels kernels_avx2 = {
+    .name = "avx2",
+    .gemm = gemm_avx2,
+    .relu = relu_avx2,
+    .gelu = gelu_avx2,
+    .softmax = softmax_avx2,
+};
+#endif /* CONFIG_AVX2_OPT */
+
+/*
+ * CONFIG_AVX512BW_OPT tells that the compiler handles AVX-512 intrinsics;
+ * the kernels themselves only need AVX-512F.
+ */
+#ifdef CONFIG_AVX512BW_OPT
+static inline __m512 __attribute__((target("avx512f")))
+exp_avx512(__m512 x)
+{
+    __m512 fx, y, z;
+    __m512i n;
+
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)),
+                      _mm512_set1_ps(EXP_HI));
+    fx = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(EXP_LOG2E),
+                                              _mm512_set1_ps(0.5f)),
+                              _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(EXP_C1), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(EXP_C2), x);
+
+    y = _mm512_set1_ps(EXP_P0);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P1));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P2));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P3));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P4));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P5));
+    z = _mm512_mul_ps(x, x);
+    y = _mm512_add_ps(_mm512_fmadd_ps(y, z, x), _mm512_set1_ps(1.0f));
+
+    n = _mm512_add_epi32(_mm512_cvttps_epi32(fx), _mm512_set1_epi32(127));
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(_mm512_slli_epi32(n, 23)));
+}
+
+/* Lanes below @n, the tails are handled with masked loads and stores */
+static inline __mmask16 tail_mask_avx512(size_t n)
+{
+    return n >= 16 ? 0xffff : (1u << n) - 1;
+}
+
+static void __attribute__((target("avx512f")))
+gemm_avx512(size_t m, size_t k, size_t n,
+            const float *a, const float *b, float *c)
+{
+    memset(c, 0, m * n * sizeof(float));
+    for (size_t i = 0; i < m; i++) {
+        float *ci = c + i * n;
+
+        for (size_t p = 0; p < k; p++) {
+            const float *bp = b + p * n;
+            __m512 vs = _mm512_set1_ps(a[i * k + p]);
+
+            for (size_t j = 0; j < n; j += 16) {
+                __mmask16 mask = tail_mask_avx512(n - j);
+                __m512 acc = _mm512_maskz_loadu_ps(mask, ci + j);
+
+                acc = _mm512_fmadd_ps(vs, _mm512_maskz_loadu_ps(mask, bp + j),
+                                      acc);
+                _mm512_mask_storeu_ps(ci + j, mask, acc);
+            }
+        }
+    }
+}
+
+static void __attribute__((target("avx512f")))
+relu_avx512(size_t n, const float *x, float *y)
+{
+    __m512 zero = _mm512_setzero_ps();
+
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 mask = tail_mask_avx512(n - i);
+
+        _mm512_mask_storeu_ps(y + i, mask,
+                              _mm512_max_ps(_mm512_maskz_loadu_ps(mask, x + i),
+                                            zero));
+    }
+}
+
+static void __attribute__((target("avx512f")))
+gelu_avx512(size_t n, const float *x, float *y)
+{
+    __m512 one = _mm512_set1_ps(1.0f);
+    __m512 two = _mm512_set1_ps(2.0f);
+
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 mask = tail_mask_avx512(n - i);
+        __m512 v = _mm512_maskz_loadu_ps(mask, x + i);
+        __m512 v3 = _mm512_mul_ps(_mm512_mul_ps(v, v), v);
+        __m512 z, t;
+
+        z = _mm512_mul_ps(_mm512_set1_ps(GELU_SCALE),
+                          _mm512_fmadd_ps(_mm512_set1_ps(GELU_CUBIC), v3, v));
+        /* tanh(z) = 1 - 2 / (e^2z + 1) */
+        t = _mm512_sub_ps(one, _mm512_div_ps(two, _mm512_add_ps(
+                                   exp_avx512(_mm512_mul_ps(two, z)), one)));
+        _mm512_mask_storeu_ps(y + i, mask,
+                              _mm512_mul_ps(_mm512_mul_ps(
+                                                _mm512_set1_ps(0.5f), v),
+                                            _mm512_add_ps(one, t)));
+    }
+}
+
+static void __attribute__((target("avx512f")))
+softmax_avx512(size_t n, const float *x, float *y)
+{
+    __m512 vmax = _mm512_set1_ps(-INFINITY);
+    __m512 vsum = _mm512_setzero_ps();
+    __m512 scale;
+
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 mask = tail_mask_avx512(n - i);
+
+        vmax = _mm512_mask_max_ps(vmax, mask, vmax,
+                                  _mm512_maskz_loadu_ps(mask, x + i));
+    }
+    vmax = _mm512_set1_ps(_mm512_reduce_max_ps(vmax));
+
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 mask = tail_mask_avx512(n - i);
+        __m512 e = exp_avx512(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i),
+                                            vmax));
+
+        _mm512_mask_storeu_ps(y + i, mask, e);
+        vsum = _mm512_mask_add_ps(vsum, mask, vsum, e);
+    }
+    scale = _mm512_set1_ps(1.0f / _mm512_reduce_add_ps(vsum));
+
+    for (size_t i = 0; i < n; i += 16) {
+        __mmask16 mask = tail_mask_avx512(n - i);
+
+        _mm512_mask_storeu_ps(y + i, mask,
+                              _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, y + i),
+                                            scale));
+    }
+}
+
+static const InferenceCpuKernels kernels_avx512 = {
+    .name = "avx512f",
+    .gemm = gemm_avx512,
+    .relu = relu_avx512,
+    .gelu = gelu_avx512,
+    .softmax = softmax_avx512,
+};
+#endif /* CONFIG_AVX512BW_OPT */
+
+const InferenceCpuKernels *inference_cpu_kernels(unsigned index)
+{
+    const InferenceCpuKernels *sets[3];
+    unsigned n = 0;
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+    unsigned info = cpuinfo_init();
+#endif
+
+#ifdef CONFIG_AVX512BW_OPT
+    if (info & CPUINFO_AVX512F) {
+        sets[n++] = &kernels_avx512;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (info & CPUINFO_AVX2) {
+        sets[n++] = &kernels_avx2;
+    }
+#endif
+    sets[n++] = &kernels_c;
+
+    return index < n ? sets[index] : NULL;
+}
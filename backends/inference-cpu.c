@@ -0,0 +1,416 @@
+/*
+ * QEMU CPU inference backend
+ *
+ * Runs one dense operator per request on the host CPU. The input buffer
+ * starts with an InferenceCpuHeader followed by the operands, the output
+ * buffer receives the result; all values are little-endian, tensors are
+ * IEEE 754 single precision and stored row-major:
+ *
+ *   MATMUL   dims = { m, k, n }        A[m][k] B[k][n]      -> C[m][n]
+ *   CONV2D   dims = { c, h, w, f, kh, kw }
+ *                                      X[c][h][w] W[f][c][kh][kw]
+ *                                                 -> Y[f][h-kh+1][w-kw+1]
+ *   RELU     dims = { n }              X[n]                 -> Y[n]
+ *   GELU     dims = { n }              X[n]                 -> Y[n]
+ *   SOFTMAX  dims = { rows, cols }     X[rows][cols]        -> Y[rows][cols]
+ *
+ * Operands that do not fit in the input, typically B or W, are taken
+ * from the weights of the model the request runs against, if any.
+ *
+ * CONV2D uses a stride of one and no padding. The kernels come from
+ * inference-cpu-kernels.c, the best set the host supports is used.
+ *
+ * Submit only validates and copies the operands; the operator runs in
+ * poll, a slice of output rows at a time, so that it can be cancelled.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qom/object_interfaces.h"
+#include "sysemu/inference-backend.h"
+#include "sysemu/inference-cpu.h"
+
+OBJECT_DECLARE_SIMPLE_TYPE(InferenceBackendCpu, INFERENCE_BACKEND_CPU)
+
+enum {
+    INFERENCE_CPU_OP_MATMUL = 1,
+    INFERENCE_CPU_OP_CONV2D = 2,
+    INFERENCE_CPU_OP_RELU = 3,
+    INFERENCE_CPU_OP_GELU = 4,
+    INFERENCE_CPU_OP_SOFTMAX = 5,
+};
+
+#define INFERENCE_CPU_MAX_DIMS 6
+
+typedef struct InferenceCpuHeader {
+    uint32_t op;
+    uint32_t reserved;
+    uint32_t dims[INFERENCE_CPU_MAX_DIMS];
+} InferenceCpuHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(InferenceCpuHeader) != 32);
+
+struct InferenceBackendCpu {
+    Object parent;
+
+    const InferenceCpuKernels *kernels;
+};
+
+/*
+ * Lowers the convolution to a GEMM: every output pixel becomes a column
+ * of the c * kh * kw input values it depends on.
+ */
+static void inference_cpu_im2col(const uint32_t *dims, const float *x,
+                                 float *col)
+{
+    size_t c = dims[0], h = dims[1], wd = dims[2];
+    size_t kh = dims[4], kw = dims[5];
+    size_t oh = h - kh + 1, ow = wd - kw + 1;
+    size_t cols = oh * ow;
+
+    for (size_t ci = 0; ci < c; ci++) {
+        for (size_t ki = 0; ki < kh; ki++) {
+            for (size_t kj = 0; kj < kw; kj++) {
+                float *dst = col + ((ci * kh + ki) * kw + kj) * cols;
+
+                for (size_t oi = 0; oi < oh; oi++) {
+                    memcpy(dst + oi * ow, x + (ci * h + oi + ki) * wd + kj,
+                           ow * sizeof(float));
+                }
+            }
+        }
+    }
+}
+
+/* Upper bound of any tensor, including the CONV2D scratch matrix */
+#define INFERENCE_CPU_MAX_ELEMS (256 * MiB / sizeof(float))
+
+/*
+ * Product of @n dimensions, or UINT64_MAX once it exceeds the limit.
+ * Partial products stay below 2^26 so the next factor cannot overflow.
+ */
+static uint64_t inference_cpu_elems(const uint64_t *dims, int n)
+{
+    uint64_t elems = 1;
+
+    for (int i = 0; i < n; i++) {
+        elems *= dims[i];
+        if (elems > INFERENCE_CPU_MAX_ELEMS) {
+            return UINT64_MAX;
+        }
+    }
+    return elems;
+}
+
+#define ELEMS(...) \
+    inference_cpu_elems((const uint64_t[]){ __VA_ARGS__ }, \
+                        ARRAY_SIZE(((const uint64_t[]){ __VA_ARGS__ })))
+
+/*
+ * Computes the number of input and output elements of @hdr, returns
+ * false if the operator or its dimensions are invalid.
+ */
+static bool inference_cpu_shape(const InferenceCpuHeader *hdr,
+                                uint64_t *in_elems, uint64_t *out_elems)
+{
+    const uint32_t *d = hdr->dims;
+    uint64_t a, b, o;
+
+    switch (hdr->op) {
+    case INFERENCE_CPU_OP_MATMUL:
+        a = ELEMS(d[0], d[1]);
+        b = ELEMS(d[1], d[2]);
+        o = ELEMS(d[0], d[2]);
+        break;
+    case INFERENCE_CPU_OP_CONV2D:
+        if (!d[4] || !d[5] || d[4] > d[1] || d[5] > d[2]) {
+            return false;
+        }
+        a = ELEMS(d[0], d[1], d[2]);
+        b = ELEMS(d[3], d[0], d[4], d[5]);
+        o = ELEMS(d[3], d[1] - d[4] + 1, d[2] - d[5] + 1);
+        /* im2col scratch matrix */
+        if (ELEMS(d[0], d[4], d[5], d[1] - d[4] + 1, d[2] - d[5] + 1) ==
+            UINT64_MAX) {
+            return false;
+        }
+        break;
+    case INFERENCE_CPU_OP_RELU:
+    case INFERENCE_CPU_OP_GELU:
+        a = o = ELEMS(d[0]);
+        b = 0;
+        break;
+    case INFERENCE_CPU_OP_SOFTMAX:
+        a = o = ELEMS(d[0], d[1]);
+        b = 0;
+        break;
+    default:
+        return false;
+    }
+
+    /* A zero dimension empties the input or the output */
+    if (!a || !o || a == UINT64_MAX || b == UINT64_MAX || o == UINT64_MAX) {
+        return false;
+    }
+    *in_elems = a + b;
+    *out_elems = o;
+    return true;
+}
+
+/* Elements of RELU and GELU handled as one row */
+#define INFERENCE_CPU_ELEMWISE_ROW 4096
+/* Multiply-adds between two checks of the poll deadline */
+#define INFERENCE_CPU_SLICE_OPS (1 << 20)
+
+/*
+ * A submitted request. The operator runs in poll(), a slice of output
+ * rows at a time, so that the device regains control at least once per
+ * poll timeout and can cancel the request between two slices.
+ */
+typedef struct InferenceCpuTask {
+    InferenceCpuHeader hdr;
+    float *in;              /* aligned copy of the operands */
+    float *col;             /* CONV2D im2col matrix */
+    float *out;             /* the output buffer, or a bounce buffer */
+    uint64_t out_elems;
+    size_t rows;            /* rows of the operator */
+    size_t step;            /* rows per slice */
+    size_t next;            /* first row not computed yet */
+} InferenceCpuTask;
+
+static void inference_cpu_task_free(InferenceRequest *req,
+                                    InferenceCpuTask *t)
+{
+    if (t->out != (float *)req->output) {
+        g_free(t->out);
+    }
+    g_free(t->col);
+    g_free(t->in);
+    g_free(t);
+    req->opaque = NULL;
+}
+
+/* Splits the operator into rows, with the cost of one row in multiply-adds */
+static void inference_cpu_task_rows(InferenceCpuTask *t)
+{
+    const uint32_t *d = t->hdr.dims;
+    size_t cost;
+
+    switch (t->hdr.op) {
+    case INFERENCE_CPU_OP_MATMUL:
+        t->rows = d[0];
+        cost = (size_t)d[1] * d[2];
+        break;
+    case INFERENCE_CPU_OP_CONV2D:
+        t->rows = d[3];
+        cost = (size_t)d[0] * d[4] * d[5] * (d[1] - d[4] + 1) *
+               (d[2] - d[5] + 1);
+        break;
+    case INFERENCE_CPU_OP_RELU:
+    case INFERENCE_CPU_OP_GELU:
+        t->rows = DIV_ROUND_UP(d[0], INFERENCE_CPU_ELEMWISE_ROW);
+        cost = INFERENCE_CPU_ELEMWISE_ROW;
+        break;
+    default:
+        t->rows = d[0];
+        cost = d[1];
+        break;
+    }
+    t->step = MAX(1, INFERENCE_CPU_SLICE_OPS / cost);
+}
+
+/* Computes the output rows [@start, @end) */
+static void inference_cpu_task_run(const InferenceCpuKernels *k,
+                                   InferenceCpuTask *t,
+                                   size_t start, size_t end)
+{
+    const uint32_t *d = t->hdr.dims;
+
+    switch (t->hdr.op) {
+    case INFERENCE_CPU_OP_MATMUL: {
+        size_t kk = d[1], n = d[2];
+
+        k->gemm(end - start, kk, n, t->in + start * kk,
+                t->in + (size_t)d[0] * kk, t->out + start * n);
+        break;
+    }
+    case INFERENCE_CPU_OP_CONV2D: {
+        size_t kk = (size_t)d[0] * d[4] * d[5];
+        size_t n = (size_t)(d[1] - d[4] + 1) * (d[2] - d[5] + 1);
+        const float *w = t->in + (size_t)d[0] * d[1] * d[2];
+
+        k->gemm(end - start, kk, n, w + start * kk, t->col,
+                t->out + start * n);
+        break;
+    }
+    case INFERENCE_CPU_OP_RELU:
+    case INFERENCE_CPU_OP_GELU: {
+        size_t first = start * INFERENCE_CPU_ELEMWISE_ROW;
+        size_t n = MIN((size_t)d[0], end * INFERENCE_CPU_ELEMWISE_ROW) - first;
+
+        if (t->hdr.op == INFERENCE_CPU_OP_RELU) {
+            k->relu(n, t->in + first, t->out + first);
+        } else {
+            k->gelu(n, t->in + first, t->out + first);
+        }
+        break;
+    }
+    case INFERENCE_CPU_OP_SOFTMAX:
+        for (size_t r = start; r < end; r++) {
+            k->softmax(d[1], t->in + r * d[1], t->out + r * d[1]);
+        }
+        break;
+    }
+}
+
+static int inference_cpu_submit(InferenceBackend *backend,
+                                InferenceRequest *req, Error **errp)
+{
+    InferenceCpuHeader hdr;
+    uint64_t in_elems, out_elems, in_avail, in_head;
+    InferenceCpuTask *t;
+
+    if (req->input_len < sizeof(hdr)) {
+        error_setg(errp, "inference-backend-cpu: request header truncated");
+        return -EINVAL;
+    }
+
+    hdr.op = ldl_le_p(req->input);
+    for (int i = 0; i < INFERENCE_CPU_MAX_DIMS; i++) {
+        hdr.dims[i] = ldl_le_p(req->input + 8 + i * 4);
+    }
+
+    if (!inference_cpu_shape(&hdr, &in_elems, &out_elems)) {
+        error_setg(errp, "inference-backend-cpu: invalid operator %u or "
+                   "dimensions", hdr.op);
+        return -EINVAL;
+    }
+    in_avail = (req->input_len - sizeof(hdr)) / sizeof(float);
+    in_head = MIN(in_elems, in_avail);
+    in_avail += req->weights_len / sizeof(float);
+    if (in_elems > in_avail || out_elems > req->output_len / sizeof(float)) {
+        error_setg(errp, "inference-backend-cpu: operator %u needs %" PRIu64
+                   " input and %" PRIu64 " output values", hdr.op,
+                   in_elems, out_elems);
+        return -EINVAL;
+    }
+
+    t = g_new0(InferenceCpuTask, 1);
+    t->hdr = hdr;
+    t->out_elems = out_elems;
+
+    /* The staging buffers are only byte aligned, the kernels need floats */
+    t->in = g_new(float, in_elems);
+    memcpy(t->in, req->input + sizeof(hdr), in_head * sizeof(float));
+    if (in_head < in_elems) {
+        memcpy(t->in + in_head, req->weights,
+               (in_elems - in_head) * sizeof(float));
+    }
+    t->out = QEMU_PTR_IS_ALIGNED(req->output, sizeof(float)) ?
+             (float *)req->output : g_new(float, out_elems);
+    if (HOST_BIG_ENDIAN) {
+        for (uint64_t i = 0; i < in_elems; i++) {
+            le32_to_cpus((uint32_t *)&t->in[i]);
+        }
+    }
+
+    if (hdr.op == INFERENCE_CPU_OP_CONV2D) {
+        t->col = g_new(float, (size_t)hdr.dims[0] * hdr.dims[4] * hdr.dims[5] *
+                              (hdr.dims[1] - hdr.dims[4] + 1) *
+                              (hdr.dims[2] - hdr.dims[5] + 1));
+        inference_cpu_im2col(hdr.dims, t->in, t->col);
+    }
+
+    inference_cpu_task_rows(t);
+    req->opaque = t;
+    return 0;
+}
+
+/* Runs slices of the request until it is complete or @timeout_ns elapsed */
+static int inference_cpu_poll(InferenceBackend *backend,
+                              InferenceRequest *req, int64_t timeout_ns)
+{
+    InferenceBackendCpu *s = INFERENCE_BACKEND_CPU(backend);
+    InferenceCpuTask *t = req->opaque;
+    int64_t deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + timeout_ns;
+
+    while (t->next < t->rows) {
+        size_t end = MIN(t->rows, t->next + t->step);
+
+        inference_cpu_task_run(s->kernels, t, t->next, end);
+        t->next = end;
+        if (t->next < t->rows &&
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= deadline) {
+            return -EINPROGRESS;
+        }
+    }
+
+    if (HOST_BIG_ENDIAN) {
+        for (uint64_t i = 0; i < t->out_elems; i++) {
+            cpu_to_le32s((uint32_t *)&t->out[i]);
+        }
+    }
+    if (t->out != (float *)req->output) {
+        memcpy(req->output, t->out, t->out_elems * sizeof(float));
+    }
+    memset(req->output + t->out_elems * sizeof(float), 0,
+           req->output_len - t->out_elems * sizeof(float));
+    inference_cpu_task_free(req, t);
+    return 0;
+}
+
+/* The slices already computed are simply thrown away */
+static void inference_cpu_cancel(InferenceBackend *backend,
+                                 InferenceRequest *req)
+{
+    inference_cpu_task_free(req, req->opaque);
+}
+
+static char *inference_cpu_get_isa(Object *obj, Error **errp)
+{
+    return g_strdup(INFERENCE_BACKEND_CPU(obj)->kernels->name);
+}
+
+static void inference_cpu_init(Object *obj)
+{
+    INFERENCE_BACKEND_CPU(obj)->kernels = inference_cpu_kernels(0);
+}
+
+static void inference_cpu_class_init(ObjectClass *oc, void *data)
+{
+    InferenceBackendClass *ibc = INFERENCE_BACKEND_CLASS(oc);
+
+    ibc->submit = inference_cpu_submit;
+    ibc->poll = inference_cpu_poll;
+    ibc->cancel = inference_cpu_cancel;
+
+    object_class_property_add_str(oc, "isa", inference_cpu_get_isa, NULL);
+    object_class_property_set_description(oc, "isa",
+        "Instruction set of the selected kernels");
+}
+
+static const TypeInfo inference_cpu_info = {
+    .name = TYPE_INFERENCE_BACKEND_CPU,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(InferenceBackendCpu),
+    .instance_init = inference_cpu_init,
+    .class_init = inference_cpu_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_INFERENCE_BACKEND },
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void register_types(void)
+{
+    type_register_static(&inference_cpu_info);
+}
+
+type_init(register_types);
@@ -0,0 +1,85 @@
+/*
+ * QEMU null inference backend
+ *
+ * Echoes the input tensor back as the output, optionally after a fixed
+ * delay. Useful to benchmark the device transport without any compute.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qom/object_interfaces.h"
+#include "sysemu/inference-backend.h"
+
+OBJECT_DECLARE_SIMPLE_TYPE(InferenceBackendNull, INFERENCE_BACKEND_NULL)
+
+struct InferenceBackendNull {
+    Object parent;
+
+    uint32_t delay_ms;
+};
+
+static int inference_null_submit(InferenceBackend *backend,
+                                 InferenceRequest *req, Error **errp)
+{
+    size_t len = MIN(req->input_len, req->output_len);
+
+    /* Both may be mapped from the same guest memory */
+    memmove(req->output, req->input, len);
+    memset(req->output + len, 0, req->output_len - len);
+    return 0;
+}
+
+static int inference_null_poll(InferenceBackend *backend,
+                               InferenceRequest *req, int64_t timeout_ns)
+{
+    InferenceBackendNull *s = INFERENCE_BACKEND_NULL(backend);
+    int64_t deadline = req->submit_ns + (int64_t)s->delay_ms * SCALE_MS;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (now < deadline) {
+        g_usleep(MIN(deadline - now, timeout_ns) / SCALE_US);
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+
+    return now < deadline ? -EINPROGRESS : 0;
+}
+
+static void inference_null_init(Object *obj)
+{
+    InferenceBackendNull *s = INFERENCE_BACKEND_NULL(obj);
+
+    object_property_add_uint32_ptr(obj, "delay-ms", &s->delay_ms,
+                                   OBJ_PROP_FLAG_READWRITE);
+}
+
+static void inference_null_class_init(ObjectClass *oc, void *data)
+{
+    InferenceBackendClass *ibc = INFERENCE_BACKEND_CLASS(oc);
+
+    ibc->submit = inference_null_submit;
+    ibc->poll = inference_null_poll;
+}
+
+static const TypeInfo inference_null_info = {
+    .name = TYPE_INFERENCE_BACKEND_NULL,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(InferenceBackendNull),
+    .instance_init = inference_null_init,
+    .class_init = inference_null_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_INFERENCE_BACKEND },
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void register_types(void)
+{
+    type_register_static(&inference_null_info);
+}
+
+type_init(register_types);
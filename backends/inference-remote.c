@@ -0,0 +1,568 @@
+/*
+ * QEMU remote inference backend
+ *
+ * Hands requests to an external engine process over a UNIX socket, see
+ * include/sysemu/inference-remote.h for the protocol. Buffers living in
+ * fd-backed RAM (the device tensor BAR, or guest RAM from a shared
+ * memory backend when the device maps DMA buffers in place) reach the
+ * engine without any copy; other buffers go through a staging memfd.
+ *
+ * Requests are asynchronous: submit sends the RUN and returns, poll
+ * waits for its reply with a timeout. The worker that polls reads the
+ * replies of every request from the non-blocking socket and wakes the
+ * others up.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/memfd.h"
+#include "qemu/lockable.h"
+#include "qemu/module.h"
+#include "qemu/rcu.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qom/object_interfaces.h"
+#include "io/channel-socket.h"
+#include "exec/cpu-common.h"
+#include "exec/ramblock.h"
+#include "sysemu/inference-backend.h"
+#include "sysemu/inference-remote.h"
+
+OBJECT_DECLARE_SIMPLE_TYPE(InferenceBackendRemote, INFERENCE_BACKEND_REMOTE)
+
+/* A memory region registered with the engine */
+typedef struct InferenceRemoteRegion {
+    uint32_t id;
+    int fd;
+    uint8_t *host;
+    uint64_t size;
+} InferenceRemoteRegion;
+
+/* A RUN sent to the engine and not answered yet, or not polled yet */
+typedef struct InferenceRemoteRun {
+    uint64_t tag;
+    InferenceRemoteRegion *staging;     /* NULL if nothing is staged */
+    bool out_staged;
+    bool done;
+    int ret;
+} InferenceRemoteRun;
+
+/* Time given to the engine to answer a cancelled RUN */
+#define INFERENCE_REMOTE_CANCEL_NS NANOSECONDS_PER_SECOND
+
+struct InferenceBackendRemote {
+    Object parent;
+
+    char *path;
+    QIOChannelSocket *sioc;
+    bool connected;
+
+    /* Protects everything below, dropped while waiting for replies */
+    QemuMutex lock;
+    GHashTable *regions;        /* RAMBlock * -> InferenceRemoteRegion */
+    uint32_t next_region;
+    GSList *staging_free;       /* InferenceRemoteRegion */
+    GHashTable *runs;           /* tag -> InferenceRemoteRun */
+    uint64_t next_tag;
+
+    /* Set while a worker waits for replies, the others wait for @replied */
+    bool reading;
+    QemuCond replied;
+    /* A reply read partially */
+    InferenceRemoteReply rx;
+    size_t rx_len;
+};
+
+static int inference_remote_send(InferenceBackendRemote *s,
+                                 InferenceRemoteMsg *msg, int fd,
+                                 Error **errp)
+{
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+
+    return qio_channel_writev_full_all(QIO_CHANNEL(s->sioc), &iov, 1,
+                                       fd < 0 ? NULL : &fd, fd < 0 ? 0 : 1,
+                                       0, errp);
+}
+
+static int inference_remote_add_region(InferenceBackendRemote *s,
+                                       InferenceRemoteRegion *region,
+                                       uint64_t fd_offset, Error **errp)
+{
+    InferenceRemoteMsg msg = {
+        .cmd = INFERENCE_REMOTE_CMD_ADD_REGION,
+        .region = region->id,
+        .size = region->size,
+        .fd_offset = fd_offset,
+    };
+
+    return inference_remote_send(s, &msg, region->fd, errp);
+}
+
+static void inference_remote_del_region(InferenceBackendRemote *s,
+                                        InferenceRemoteRegion *region)
+{
+    InferenceRemoteMsg msg = {
+        .cmd = INFERENCE_REMOTE_CMD_DEL_REGION,
+        .region = region->id,
+    };
+
+    /* A broken connection fails the next RUN anyway */
+    inference_remote_send(s, &msg, -1, NULL);
+}
+
+/*
+ * Describes @len bytes at @host for the engine if they live in fd-backed
+ * RAM, registering the RAMBlock on first use. Returns false if the
+ * buffer must be staged.
+ */
+static bool inference_remote_lookup(InferenceBackendRemote *s, void *host,
+                                    size_t len, InferenceRemoteBuf *buf,
+                                    Error **errp)
+{
+    InferenceRemoteRegion *region;
+    RAMBlock *rb;
+    ram_addr_t offset;
+    uint8_t *rb_host;
+    uint64_t rb_size, fd_offset;
+    int fd;
+
+    /* The caller keeps the block alive, it maps the buffer */
+    WITH_RCU_READ_LOCK_GUARD() {
+        rb = qemu_ram_block_from_host(host, false, &offset);
+        if (!rb || rb->fd < 0 || offset + len > rb->used_length) {
+            return false;
+        }
+        fd = rb->fd;
+        rb_host = rb->host;
+        rb_size = rb->max_length;
+        fd_offset = rb->fd_offset;
+    }
+
+    /* A freed block whose address got reused must be registered again */
+    region = g_hash_table_lookup(s->regions, rb);
+    if (region && (region->fd != fd || region->host != rb_host)) {
+        inference_remote_del_region(s, region);
+        g_hash_table_remove(s->regions, rb);
+        region = NULL;
+    }
+
+    if (!region) {
+        region = g_new0(InferenceRemoteRegion, 1);
+        region->id = s->next_region++;
+        region->fd = fd;
+        region->host = rb_host;
+        region->size = rb_size;
+        if (inference_remote_add_region(s, region, fd_offset, errp) < 0) {
+            g_free(region);
+            return false;
+        }
+        g_hash_table_insert(s->regions, rb, region);
+    }
+
+    buf->region = region->id;
+    buf->offset = offset;
+    buf->len = len;
+    return true;
+}
+
+static void inference_remote_staging_free(InferenceRemoteRegion *staging)
+{
+    qemu_memfd_free(staging->host, staging->size, staging->fd);
+    g_free(staging);
+}
+
+/* Takes a staging memfd of at least @size bytes */
+static InferenceRemoteRegion *inference_remote_staging_get(
+    InferenceBackendRemote *s, size_t size, Error **errp)
+{
+    InferenceRemoteRegion *staging;
+
+    if (s->staging_free) {
+        staging = s->staging_free->data;
+        s->staging_free = g_slist_delete_link(s->staging_free,
+                                              s->staging_free);
+        if (staging->size >= size) {
+            return staging;
+        }
+        inference_remote_del_region(s, staging);
+        inference_remote_staging_free(staging);
+    }
+
+    staging = g_new0(InferenceRemoteRegion, 1);
+    staging->size = pow2ceil(size);
+    staging->host = qemu_memfd_alloc("inference-remote-staging",
+                                     staging->size,
+                                     F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                                     &staging->fd, errp);
+    if (!staging->host) {
+        g_free(staging);
+        return NULL;
+    }
+    staging->id = s->next_region++;
+    if (inference_remote_add_region(s, staging, 0, errp) < 0) {
+        inference_remote_staging_free(staging);
+        return NULL;
+    }
+    return staging;
+}
+
+static void inference_remote_run_free(InferenceBackendRemote *s,
+                                      InferenceRemoteRun *run)
+{
+    if (run->staging) {
+        s->staging_free = g_slist_prepend(s->staging_free, run->staging);
+    }
+    g_hash_table_remove(s->runs, &run->tag);
+    g_free(run);
+}
+
+/*
+ * Fails every RUN in flight and stops talking to the engine. Shutting
+ * the socket down rather than closing it wakes up a reader in poll.
+ */
+static void inference_remote_disconnect(InferenceBackendRemote *s)
+{
+    GHashTableIter iter;
+    InferenceRemoteRun *run;
+
+    if (!s->connected) {
+        return;
+    }
+    error_report("inference-backend-remote: disconnected from the engine at %s", s->path);
+    qio_channel_shutdown(QIO_CHANNEL(s->sioc), QIO_CHANNEL_SHUTDOWN_BOTH,
+                         NULL);
+    s->connected = false;
+
+    g_hash_table_iter_init(&iter, s->runs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&run)) {
+        if (!run->done) {
+            run->done = true;
+            run->ret = -EIO;
+        }
+    }
+    qemu_cond_broadcast(&s->replied);
+}
+
+/* Only 0 and negative errnos other than -EINPROGRESS are valid results */
+static int inference_remote_reply_ret(int32_t ret)
+{
+    if (ret > 0 || ret < -4095 || ret == -EINPROGRESS) {
+        return -EIO;
+    }
+    return ret;
+}
+
+/* Called with s->lock held */
+static void inference_remote_dispatch(InferenceBackendRemote *s,
+                                      const InferenceRemoteReply *reply)
+{
+    InferenceRemoteRun *run = g_hash_table_lookup(s->runs, &reply->tag);
+
+    if (!run || run->done) {
+        error_report("inference-backend-remote: reply for unknown request "
+                     "%" PRIu64, reply->tag);
+        inference_remote_disconnect(s);
+        return;
+    }
+    run->ret = inference_remote_reply_ret(reply->ret);
+    run->done = true;
+}
+
+/*
+ * Waits at most @timeout_ns for the engine, then reads and dispatches
+ * the replies it sent. Called with s->lock held by the single reader,
+ * the lock is dropped while waiting.
+ */
+static void inference_remote_receive(InferenceBackendRemote *s,
+                                     int64_t timeout_ns)
+{
+    GPollFD pfd = {
+        .fd = s->sioc->fd,
+        .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+    };
+    ssize_t len;
+
+    s->reading = true;
+    qemu_mutex_unlock(&s->lock);
+    qemu_poll_ns(&pfd, 1, timeout_ns);
+    qemu_mutex_lock(&s->lock);
+    s->reading = false;
+
+    while (s->connected) {
+        len = qio_channel_read(QIO_CHANNEL(s->sioc),
+                               (char *)&s->rx + s->rx_len,
+                               sizeof(s->rx) - s->rx_len, NULL);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            break;
+        }
+        if (len <= 0) {
+            inference_remote_disconnect(s);
+            break;
+        }
+        s->rx_len += len;
+        if (s->rx_len == sizeof(s->rx)) {
+            s->rx_len = 0;
+            inference_remote_dispatch(s, &s->rx);
+        }
+    }
+
+    /* Replies arrived, or another worker may take over the reading */
+    qemu_cond_broadcast(&s->replied);
+}
+
+/*
+ * Waits until @run is answered or @timeout_ns elapsed, returns whether
+ * it was answered. Called with s->lock held.
+ */
+static bool inference_remote_wait(InferenceBackendRemote *s,
+                                  InferenceRemoteRun *run, int64_t timeout_ns)
+{
+    int64_t deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + timeout_ns;
+
+    while (!run->done) {
+        int64_t left = deadline - qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        if (left <= 0) {
+            return false;
+        }
+        if (s->reading) {
+            qemu_cond_timedwait(&s->replied, &s->lock,
+                                DIV_ROUND_UP(left, SCALE_MS));
+        } else {
+            inference_remote_receive(s, left);
+        }
+    }
+    return true;
+}
+
+static int inference_remote_submit(InferenceBackend *backend,
+                                   InferenceRequest *req, Error **errp)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(backend);
+    InferenceRemoteMsg msg = { .cmd = INFERENCE_REMOTE_CMD_RUN };
+    InferenceRemoteRun *run;
+    bool in_place, out_place = false;
+    Error *local_err = NULL;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!s->connected) {
+        error_setg(errp, "inference-backend-remote: not connected");
+        return -ENOTCONN;
+    }
+    /* The engine loads its models itself, the protocol carries no weights */
+    if (req->weights) {
+        error_setg(errp, "inference-backend-remote: device weights are not "
+                   "supported");
+        return -ENOTSUP;
+    }
+
+    in_place = inference_remote_lookup(s, (void *)req->input, req->input_len,
+                                       &msg.input, &local_err);
+    if (!local_err) {
+        out_place = inference_remote_lookup(s, req->output, req->output_len,
+                                            &msg.output, &local_err);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EIO;
+    }
+
+    run = g_new0(InferenceRemoteRun, 1);
+    run->tag = s->next_tag++;
+    run->out_staged = !out_place;
+    if (!in_place || !out_place) {
+        run->staging = inference_remote_staging_get(s, req->input_len +
+                                                    req->output_len, errp);
+        if (!run->staging) {
+            g_free(run);
+            return -EIO;
+        }
+    }
+    if (!in_place) {
+        memcpy(run->staging->host, req->input, req->input_len);
+        msg.input = (InferenceRemoteBuf) {
+            .region = run->staging->id,
+            .len = req->input_len,
+        };
+    }
+    if (!out_place) {
+        msg.output = (InferenceRemoteBuf) {
+            .region = run->staging->id,
+            .offset = req->input_len,
+            .len = req->output_len,
+        };
+    }
+    msg.tag = run->tag;
+    g_hash_table_insert(s->runs, &run->tag, run);
+
+    if (inference_remote_send(s, &msg, -1, errp) < 0) {
+        inference_remote_run_free(s, run);
+        inference_remote_disconnect(s);
+        return -EIO;
+    }
+
+    req->opaque = run;
+    return 0;
+}
+
+static int inference_remote_poll(InferenceBackend *backend,
+                                 InferenceRequest *req, int64_t timeout_ns)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(backend);
+    InferenceRemoteRun *run = req->opaque;
+    int ret;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!inference_remote_wait(s, run, timeout_ns)) {
+        return -EINPROGRESS;
+    }
+
+    ret = run->ret;
+    if (run->out_staged && ret == 0) {
+        memcpy(req->output, run->staging->host + req->input_len,
+               req->output_len);
+    }
+    inference_remote_run_free(s, run);
+    req->opaque = NULL;
+    return ret;
+}
+
+/*
+ * The engine may write the output until it answers, so the RUN is only
+ * dropped once answered. An engine that does not answer in time is
+ * disconnected.
+ */
+static void inference_remote_cancel(InferenceBackend *backend,
+                                    InferenceRequest *req)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(backend);
+    InferenceRemoteRun *run = req->opaque;
+    InferenceRemoteMsg msg = {
+        .cmd = INFERENCE_REMOTE_CMD_CANCEL,
+        .tag = run->tag,
+    };
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!run->done && inference_remote_send(s, &msg, -1, NULL) < 0) {
+        inference_remote_disconnect(s);
+    }
+    if (!inference_remote_wait(s, run, INFERENCE_REMOTE_CANCEL_NS)) {
+        inference_remote_disconnect(s);
+    }
+    inference_remote_run_free(s, run);
+    req->opaque = NULL;
+}
+
+static void inference_remote_complete(UserCreatable *uc, Error **errp)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(uc);
+    SocketAddress addr = {
+        .type = SOCKET_ADDRESS_TYPE_UNIX,
+        .u.q_unix.path = s->path,
+    };
+    QIOChannelSocket *sioc;
+
+    if (!s->path) {
+        error_setg(errp, "inference-backend-remote: 'path' is required");
+        return;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, &addr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return;
+    }
+    /* Replies are read by whichever worker polls, without blocking */
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
+    s->sioc = sioc;
+    s->connected = true;
+}
+
+static char *inference_remote_get_path(Object *obj, Error **errp)
+{
+    return g_strdup(INFERENCE_BACKEND_REMOTE(obj)->path);
+}
+
+static void inference_remote_set_path(Object *obj, const char *value,
+                                      Error **errp)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(obj);
+
+    if (s->sioc) {
+        error_setg(errp, "cannot change the path of a connected backend");
+        return;
+    }
+    g_free(s->path);
+    s->path = g_strdup(value);
+}
+
+static void inference_remote_init(Object *obj)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(obj);
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->replied);
+    s->regions = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    s->runs = g_hash_table_new(g_int64_hash, g_int64_equal);
+}
+
+static void inference_remote_finalize(Object *obj)
+{
+    InferenceBackendRemote *s = INFERENCE_BACKEND_REMOTE(obj);
+
+    if (s->sioc) {
+        qio_channel_close(QIO_CHANNEL(s->sioc), NULL);
+        object_unref(OBJECT(s->sioc));
+    }
+    g_slist_free_full(s->staging_free,
+                      (GDestroyNotify)inference_remote_staging_free);
+    g_hash_table_destroy(s->runs);
+    g_hash_table_destroy(s->regions);
+    qemu_cond_destroy(&s->replied);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->path);
+}
+
+static void inference_remote_class_init(ObjectClass *oc, void *data)
+{
+    InferenceBackendClass *ibc = INFERENCE_BACKEND_CLASS(oc);
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ibc->submit = inference_remote_submit;
+    ibc->poll = inference_remote_poll;
+    ibc->cancel = inference_remote_cancel;
+    ucc->complete = inference_remote_complete;
+
+    object_class_property_add_str(oc, "path", inference_remote_get_path,
+                                  inference_remote_set_path);
+    object_class_property_set_description(oc, "path",
+        "UNIX socket of the inference engine");
+}
+
+static const TypeInfo inference_remote_info = {
+    .name = TYPE_INFERENCE_BACKEND_REMOTE,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(InferenceBackendRemote),
+    .instance_init = inference_remote_init,
+    .instance_finalize = inference_remote_finalize,
+    .class_init = inference_remote_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_INFERENCE_BACKEND },
+        { TYPE_USER_CREATABLE },
+        { }
+    }
+};
+
+static void register_types(void)
+{
+    type_register_static(&inference_remote_info);
+}
+
+type_init(register_types);
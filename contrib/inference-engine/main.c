@@ -0,0 +1,274 @@
+/*
+ * Reference engine for the remote inference backend
+ *
+ * Listens on a UNIX socket, maps the memory regions QEMU passes and
+ * answers every RUN by copying the input tensor to the output, like
+ * inference-backend-null. Real engines replace inference_engine_run().
+ *
+ * RUNs are served one at a time and answered before the next message is
+ * read, so a CANCEL always refers to a RUN that was answered already.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "qemu/cutils.h"
+#include "sysemu/inference-remote.h"
+
+#define INFERENCE_ENGINE_DEFAULT_UNIX_SOCK_PATH "/tmp/inference-engine.sock"
+
+typedef struct InferenceEngineRegion {
+    uint8_t *ptr;
+    uint64_t size;
+} InferenceEngineRegion;
+
+static bool verbose;
+
+/* Regions are indexed by the id QEMU gave them */
+static GArray *regions;
+
+#define INFERENCE_ENGINE_DEBUG(fmt, ...) do { \
+        if (verbose) {                        \
+            printf(fmt, ## __VA_ARGS__);      \
+        }                                     \
+    } while (0)
+
+static void
+inference_engine_usage(const char *progname)
+{
+    printf("Usage: %s [OPTION]...\n"
+           "  -h: show this help\n"
+           "  -v: verbose mode\n"
+           "  -S <unix-socket-path>: path to the unix socket to listen to\n"
+           "     default " INFERENCE_ENGINE_DEFAULT_UNIX_SOCK_PATH "\n",
+           progname);
+}
+
+/* read one message and the fd it may carry */
+static int
+inference_engine_read_msg(int sock, InferenceRemoteMsg *req, int *fd)
+{
+    struct msghdr msg = {};
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    union {
+        struct cmsghdr cmsg;
+        char control[CMSG_SPACE(sizeof(int))];
+    } msg_control;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &msg_control;
+    msg.msg_controllen = sizeof(msg_control);
+
+    ret = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (ret != sizeof(*req)) {
+        return -1;
+    }
+
+    *fd = -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_len == CMSG_LEN(sizeof(int)) &&
+            cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+        }
+    }
+    return 0;
+}
+
+static uint8_t *
+inference_engine_buf(const InferenceRemoteBuf *buf)
+{
+    InferenceEngineRegion *region;
+
+    if (buf->region >= regions->len) {
+        return NULL;
+    }
+    region = &g_array_index(regions, InferenceEngineRegion, buf->region);
+    if (!region->ptr || buf->offset > region->size ||
+        buf->len > region->size - buf->offset) {
+        return NULL;
+    }
+    return region->ptr + buf->offset;
+}
+
+static int
+inference_engine_run(const uint8_t *input, uint64_t input_len,
+                     uint8_t *output, uint64_t output_len)
+{
+    uint64_t len = MIN(input_len, output_len);
+
+    memmove(output, input, len);
+    memset(output + len, 0, output_len - len);
+    return 0;
+}
+
+static void
+inference_engine_add_region(const InferenceRemoteMsg *req, int fd)
+{
+    InferenceEngineRegion region = { .size = req->size };
+
+    if (fd < 0) {
+        fprintf(stderr, "region %u comes without a file descriptor\n",
+                req->region);
+        return;
+    }
+
+    region.ptr = mmap(NULL, req->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, req->fd_offset);
+    close(fd);
+    if (region.ptr == MAP_FAILED) {
+        fprintf(stderr, "cannot map region %u: %s\n", req->region,
+                strerror(errno));
+        return;
+    }
+
+    if (req->region >= regions->len) {
+        g_array_set_size(regions, req->region + 1);
+    }
+    g_array_index(regions, InferenceEngineRegion, req->region) = region;
+    INFERENCE_ENGINE_DEBUG("region %u: %" PRIu64 " bytes\n",
+                           req->region, req->size);
+}
+
+static void
+inference_engine_del_region(const InferenceRemoteMsg *req)
+{
+    InferenceEngineRegion *region;
+
+    if (req->region >= regions->len) {
+        return;
+    }
+    region = &g_array_index(regions, InferenceEngineRegion, req->region);
+    if (region->ptr) {
+        munmap(region->ptr, region->size);
+    }
+    region->ptr = NULL;
+    INFERENCE_ENGINE_DEBUG("region %u removed\n", req->region);
+}
+
+/* serve one QEMU connection until it goes away */
+static void
+inference_engine_serve(int sock)
+{
+    InferenceRemoteMsg req;
+    int fd;
+
+    regions = g_array_new(FALSE, TRUE, sizeof(InferenceEngineRegion));
+
+    while (inference_engine_read_msg(sock, &req, &fd) == 0) {
+        InferenceRemoteReply reply = { .tag = req.tag };
+        const uint8_t *input;
+        uint8_t *output;
+
+        switch (req.cmd) {
+        case INFERENCE_REMOTE_CMD_ADD_REGION:
+            inference_engine_add_region(&req, fd);
+            continue;
+        case INFERENCE_REMOTE_CMD_DEL_REGION:
+            inference_engine_del_region(&req);
+            break;
+        case INFERENCE_REMOTE_CMD_RUN:
+            input = inference_engine_buf(&req.input);
+            output = inference_engine_buf(&req.output);
+            reply.ret = input && output ?
+                inference_engine_run(input, req.input.len,
+                                     output, req.output.len) : -EINVAL;
+            INFERENCE_ENGINE_DEBUG("run %" PRIu64 ": %" PRIu64 " -> %" PRIu64
+                                   " bytes: %d\n", req.tag, req.input.len,
+                                   req.output.len, reply.ret);
+            if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) !=
+                sizeof(reply)) {
+                goto out;
+            }
+            break;
+        case INFERENCE_REMOTE_CMD_CANCEL:
+            INFERENCE_ENGINE_DEBUG("cancel %" PRIu64 ": already answered\n",
+                                   req.tag);
+            break;
+        default:
+            fprintf(stderr, "unknown command %u\n", req.cmd);
+            break;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+out:
+    for (unsigned i = 0; i < regions->len; i++) {
+        InferenceEngineRegion *region =
+            &g_array_index(regions, InferenceEngineRegion, i);
+
+        if (region->ptr) {
+            munmap(region->ptr, region->size);
+        }
+    }
+    g_array_free(regions, TRUE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = INFERENCE_ENGINE_DEFAULT_UNIX_SOCK_PATH;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int listen_sock, c;
+
+    while ((c = getopt(argc, argv, "hvS:")) != -1) {
+        switch (c) {
+        case 'v': /* verbose */
+            verbose = true;
+            break;
+
+        case 'S': /* unix socket path */
+            path = optarg;
+            break;
+
+        case 'h': /* help */
+        default:
+            inference_engine_usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return 1;
+    }
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+
+    listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_sock, 1) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    for (;;) {
+        int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        INFERENCE_ENGINE_DEBUG("QEMU connected\n");
+        inference_engine_serve(sock);
+        close(sock);
+        INFERENCE_ENGINE_DEBUG("QEMU disconnected\n");
+    }
+}
@@ -121,8 +121,10 @@ pub fn search(
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 use std::{
-    hint,
-    time::{Duration, Instant},
+    fs::File,
+    io::Read,
+    os::fd::{AsRawFd, FromRawFd, RawFd},
+    time::Duration,
 };
 
 use tock_registers::{
@@ -136,17 +138,41 @@ struct InferenceDevice {
     region1: MappedOwningPciRegion,
     region2: MappedOwningPciRegion,
     register_space: &'static RegisterSpace,
-    input_data: &'static [u8; 4096], //раскур плотный
-    output_data: &'static [u8; 4096],
+    // BAR1 is the tensor memory: input in the lower half, output in the upper one
+    input_data: &'static [u8], //раскур плотный
+    output_data: &'static [u8],
+    // One eventfd per MSI-X vector: vector N is queue N, the last one is the error vector
+    eventfds: Vec<File>,
 }
 
+const INFERENCE_TIMEOUT: Duration = Duration::from_millis(3000);
+
+fn new_eventfd() -> std::io::Result<File> {
+    let fd = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC) };
+    if fd < 0 {
+        return Err(std::io::Error::last_os_error());
+    }
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+// BAR0 only takes 32-bit accesses, so 64-bit registers are written as lo/hi halves
 register_structs! {
     pub RegisterSpace{
         (0x00   => control: ReadWrite<u32, Control::Register>),
         (0x04   => control_w1s: ReadWrite<u32, Control::Register>),
         (0x08   => control_w1c: ReadWrite<u32, Control::Register>),
         (0x0C   => status: ReadOnly<u32, Status::Register>),
-        (0x10   => _reserved),
+        (0x10   => dma_src_lo: ReadWrite<u32>),
+        (0x14   => dma_src_hi: ReadWrite<u32>),
+        (0x18   => dma_dst_lo: ReadWrite<u32>),
+        (0x1C   => dma_dst_hi: ReadWrite<u32>),
+        (0x20   => dma_src_len: ReadWrite<u32>),
+        (0x24   => dma_dst_len: ReadWrite<u32>),
+        (0x28   => sg_table_lo: ReadWrite<u32>),
+        (0x2C   => sg_table_hi: ReadWrite<u32>),
+        (0x30   => sg_count: ReadWrite<u32>),
+        (0x34   => num_queues: ReadOnly<u32>),
+        (0x38   => _reserved),
         (0x40   => @END),
     }
 
@@ -156,7 +182,9 @@ register_bitfields![u32,
     pub Control [
         START OFFSET(0) NUMBITS(1),
         STOP OFFSET(1) NUMBITS(1),
-        RESET OFFSET(2) NUMBITS(1)
+        RESET OFFSET(2) NUMBITS(1),
+        DMA OFFSET(3) NUMBITS(1),
+        SG OFFSET(4) NUMBITS(1)
     ],
 
     pub Status[
@@ -195,21 +223,29 @@ impl InferenceDevice {
         let ptr0 = mappedbar0.as_ptr().cast::<RegisterSpace>();
         let reg_space0 = unsafe { ptr0.as_ref()? }; //зуб даю
 
-        let mappedbar1 = device
-            .bar(1)?
-            .map(0..4096, pci_driver::regions::Permissions::ReadWrite)
+        let bar1 = device.bar(1)?;
+        let half = bar1.len() / 2;
+        let mappedbar1 = bar1
+            .map(0..half, pci_driver::regions::Permissions::ReadWrite)
             .unwrap();
 
-        let ptr1 = mappedbar1.as_ptr().cast::<[u8; 4096]>();
-        let input_memory = unsafe { ptr1.as_ref()? }; //зуб даю
+        let input_memory =
+            unsafe { std::slice::from_raw_parts(mappedbar1.as_ptr(), half as usize) }; //зуб даю
 
-        let mappedbar2 = device
-            .bar(0)?
-            .map(0..4096, pci_driver::regions::Permissions::Read)
+        let mappedbar2 = bar1
+            .map(half..2 * half, pci_driver::regions::Permissions::Read)
             .unwrap();
 
-        let ptr2 = mappedbar2.as_ptr().cast::<[u8; 4096]>();
-        let output_memory = unsafe { ptr2.as_ref()? }; //зуб даю
+        let output_memory =
+            unsafe { std::slice::from_raw_parts(mappedbar2.as_ptr(), half as usize) }; //зуб даю
+
+        let msix = device.interrupts().msi_x();
+        let eventfds = (0..msix.max())
+            .map(|_| new_eventfd())
+            .collect::<Result<Vec<_>, _>>()
+            .ok()?;
+        msix.enable(&eventfds.iter().map(|fd| fd.as_raw_fd()).collect::<Vec<RawFd>>())
+            .ok()?;
 
         let result = Self {
             region0: mappedbar0,
@@ -218,6 +254,7 @@ impl InferenceDevice {
             register_space: reg_space0,
             input_data: input_memory,
             output_data: output_memory,
+            eventfds,
         };
         result.reset();
         Some(result)
@@ -226,14 +263,34 @@ impl InferenceDevice {
         self.register_space.control.write(Control::RESET::SET);
 
     }
+    // Sleeps until the device signals `vector`, no CPU is burnt while waiting
+    fn wait_irq(&self, vector: usize, timeout: Duration) -> bool {
+        let eventfd = &self.eventfds[vector];
+        let mut pollfd = libc::pollfd {
+            fd: eventfd.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        if unsafe { libc::poll(&mut pollfd, 1, timeout.as_millis() as libc::c_int) } <= 0 {
+            return false;
+        }
+        let mut counter = [0u8; 8];
+        (&*eventfd).read_exact(&mut counter).is_ok()
+    }
+    // Runs on the whole input half of BAR1 and writes the whole output half
     fn do_inference(&self) -> Result<(), ()> {
-        let wait_until = Instant::now() + Duration::from_millis(1000);
-        self.register_space.control.write(Control::START::SET);
-        while wait_until > Instant::now() {
-            if !self.register_space.status.is_set(Status::DONE) {
-                return Ok(());
-            }
-            hint::spin_loop();
+        let regs = self.register_space;
+        // Without DMA, dma_src/dma_dst are offsets in BAR1 and the lengths bound the tensors
+        regs.dma_src_lo.set(0);
+        regs.dma_src_hi.set(0);
+        regs.dma_dst_lo.set(self.input_data.len() as u32);
+        regs.dma_dst_hi.set(0);
+        regs.dma_src_len.set(self.input_data.len() as u32);
+        regs.dma_dst_len.set(self.output_data.len() as u32);
+        regs.control.write(Control::START::SET);
+        // The START job completes on the vector of queue 0
+        if self.wait_irq(0, INFERENCE_TIMEOUT) && self.is_done() {
+            return Ok(());
         }
         Err(())
     }
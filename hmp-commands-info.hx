@@ -979,3 +979,17 @@ SRST
   ``info cryptodev``
     Show the crypto devices.
 ERST
+
+    {
+        .name       = "inference",
+        .args_type  = "id:s",
+        .params     = "id",
+        .help       = "show the counters and latency percentiles of an inference device",
+        .cmd        = hmp_info_inference,
+    },
+
+SRST
+  ``info inference`` *id*
+    Show the activity counters and per-queue latency percentiles of the
+    pci-inference-device *id*.
+ERST
@@ -0,0 +1,63 @@
+/*
+ * Human Monitor Interface commands of pci-inference-device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "monitor/hmp.h"
+#include "monitor/monitor.h"
+#include "qapi/qapi-commands-inference.h"
+#include "qapi/qmp/qdict.h"
+
+static void hmp_inference_latency(Monitor *mon, const char *stage,
+                                  const InferenceLatency *latency)
+{
+    monitor_printf(mon, "    %-16s %10" PRIu64 " %12" PRIu64 " %12" PRIu64
+                   " %12" PRIu64 "\n", stage, latency->samples,
+                   latency->p50, latency->p99, latency->p999);
+}
+
+void hmp_info_inference(Monitor *mon, const QDict *qdict)
+{
+    const char *id = qdict_get_str(qdict, "id");
+    InferenceQueueLatencyList *queue;
+    InferenceDeviceStats *stats;
+    uint64List *depth;
+    Error *err = NULL;
+    int i = 0;
+
+    stats = qmp_query_inference_device_stats(id, &err);
+    if (hmp_handle_error(mon, err)) {
+        return;
+    }
+
+    monitor_printf(mon, "submitted: %" PRIu64 "\n", stats->submitted);
+    monitor_printf(mon, "completed: %" PRIu64 "\n", stats->completed);
+    monitor_printf(mon, "errors: %" PRIu64 "\n", stats->errors);
+    monitor_printf(mon, "bytes in: %" PRIu64 "\n", stats->bytes_in);
+    monitor_printf(mon, "bytes out: %" PRIu64 "\n", stats->bytes_out);
+    monitor_printf(mon, "busy: %" PRIu64 " ns\n", stats->busy_ns);
+
+    monitor_printf(mon, "queue depth:");
+    for (depth = stats->queue_depth; depth; depth = depth->next, i++) {
+        monitor_printf(mon, " %s%d: %" PRIu64, depth->next ? "" : ">=",
+                       1 << i, depth->value);
+    }
+    monitor_printf(mon, "\n");
+
+    for (queue = stats->queues; queue; queue = queue->next) {
+        monitor_printf(mon, "queue %u latency (ns):\n", queue->value->queue);
+        monitor_printf(mon, "    %-16s %10s %12s %12s %12s\n",
+                       "stage", "samples", "p50", "p99", "p99.9");
+        hmp_inference_latency(mon, "submit-to-start",
+                              queue->value->submit_to_start);
+        hmp_inference_latency(mon, "start-to-finish",
+                              queue->value->start_to_finish);
+        hmp_inference_latency(mon, "finish-to-irq",
+                              queue->value->finish_to_irq);
+    }
+
+    qapi_free_InferenceDeviceStats(stats);
+}
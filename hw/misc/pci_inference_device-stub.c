@@ -0,0 +1,17 @@
+/*
+ * QMP command stubs for builds without pci-inference-device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-inference.h"
+
+InferenceDeviceStats *qmp_query_inference_device_stats(const char *id,
+                                                       Error **errp)
+{
+    error_setg(errp, "pci-inference-device support is not compiled in");
+    return NULL;
+}
@@ -1,17 +1,113 @@
 #include "qemu/osdep.h"
+#include "qemu/log.h"
 #include "qemu/units.h"
 #include "hw/pci/pci.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/rcu.h"
 #include "qom/object.h"
 #include "qemu/main-loop.h" /* iothread mutex */
 #include "qemu/module.h"
+#include "qapi/error.h"
 #include "qapi/visitor.h"
+#include "qapi/qapi-commands-inference.h"
+#include "hw/qdev-properties.h"
+#include "qemu/event_notifier.h"
+#include "sysemu/iothread.h"
+#include "sysemu/inference-backend.h"
+#include "qemu/error-report.h"
+#include "qemu/memfd.h"
+#include "migration/vmstate.h"
+#include "sysemu/runstate.h"
+#include "qemu/ptr-ring.h"
+#include "qemu/processor.h"
+#include "qemu/thread-context.h"
+#include "qemu/stats64.h"
+#include "qemu/qdist.h"
+#include "qemu/queue.h"
+#include "qemu/lockable.h"
+#include "qemu/host-utils.h"
+#include "qemu/range.h"
+#include "sysemu/numa.h"
+#include "trace.h"
+
+#ifdef CONFIG_NUMA
+#include <numaif.h>
+#endif
 
 #define TYPE_PCI_CUSTOM_DEVICE "pci-inference-device"
 #define PCI_INFERENCE_DEVICE_VENDOR_ID 0xCAFE
 
+/* Defaults of the timing model, roughly a small edge accelerator */
+#define INFERENCE_MODEL_CLOCK_MHZ 1000
+#define INFERENCE_MODEL_OPS_PER_CYCLE 4096
+#define INFERENCE_MODEL_OPS_PER_BYTE 256
+#define INFERENCE_MODEL_BANDWIDTH_MBPS 16000
+#define INFERENCE_MODEL_OVERHEAD_NS (20 * SCALE_US)
+
+/* Workers check for STOP and RESET at least this often while a job runs */
+#define INFERENCE_POLL_NS (10 * SCALE_MS)
+
+/* Tensor memory behind BAR1, a START without DMA runs on two ranges of it */
+#define INFERENCE_MEM_DEFAULT_SIZE (256 * MiB)
+#define INFERENCE_MEM_MIN_SIZE (8 * KiB)
+
+/* Upper bound of a single DMA transfer, the device stages it in host memory */
+#define INFERENCE_DMA_MAX_LEN (64 * MiB)
+
+/* Values of the `error` field of the status register */
+#define INFERENCE_ERROR_NONE 0x0
+#define INFERENCE_ERROR_DMA 0x1	   /* Transfer to or from guest RAM failed */
+#define INFERENCE_ERROR_LENGTH 0x2 /* Length is zero, too big, or leaves the tensor memory */
+#define INFERENCE_ERROR_DESC 0x3   /* Malformed scatter-gather descriptor chain */
+#define INFERENCE_ERROR_BACKEND 0x4 /* Inference backend failed the job */
+#define INFERENCE_ERROR_MODEL 0x5	/* Model not resident, or too big for the cache */
+
+/* Upper bound of the scatter-gather descriptor table */
+#define INFERENCE_SG_MAX_DESC 1024
+
+/* Flags of a scatter-gather descriptor, same meaning as VRING_DESC_F_* */
+#define INFERENCE_SG_DESC_F_NEXT 0x1  /* Chain continues via the `next` field */
+#define INFERENCE_SG_DESC_F_WRITE 0x2 /* Buffer is written by the device (output) */
+
+/* Submission queues, each one owns a 4 KiB page of BAR0 after the global registers */
+#define INFERENCE_MAX_QUEUES 64
+#define INFERENCE_QUEUE_MAX_INFLIGHT 32 /* jobs a queue may have fetched and not freed */
+#define INFERENCE_POOL_MAX_WORKERS 64
+#define INFERENCE_QUEUE_STRIDE 0x1000
+#define INFERENCE_QUEUE_MAX_SIZE 4096
+
+/* MSI-X: vector N signals completions of queue N, the last vector signals errors */
+#define INFERENCE_MSIX_BAR 3
+#define INFERENCE_IRQ_DONE 0x1
+#define INFERENCE_IRQ_ERROR 0x2
+
+/* Read-only activity counters in the global page of BAR0, see enum InferenceStat */
+#define INFERENCE_STATS_OFFSET 0x800
+#define INFERENCE_STATS_DEPTH_BUCKETS 8
+
+/* Flags of a submission queue entry */
+#define INFERENCE_SUBMIT_F_SG 0x1 /* src/dst are unused, data are described by sg_table */
+#define INFERENCE_SUBMIT_F_BATCH 0x2 /* sg_table/sg_count describe an array of submissions completed as one */
+#define INFERENCE_SUBMIT_F_LOAD 0x4	 /* the input holds the weights of `model`, there is no output; later entries wait */
+
+/* Weights of the resident models, kept in device RAM between jobs */
+#define INFERENCE_WEIGHT_CACHE_DEFAULT_SIZE (256 * MiB)
+
+/*
+ * Worker threads and the device AioContext run without the BQL, which MMIO
+ * dispatch would take. Their DMA is restricted to RAM so that it never
+ * waits for the BQL; DMA that hits anything else fails with MEMTX_ACCESS_ERROR.
+ */
+#define INFERENCE_DMA_ATTRS ((MemTxAttrs){.memory = true})
+
+/* A batch fans out to the pool at once, so bound what it may pin or allocate */
+#define INFERENCE_BATCH_MAX_JOBS 64
+#define INFERENCE_BATCH_MAX_LEN (2 * INFERENCE_DMA_MAX_LEN)
+
 /* This macro provides the instance type cast functions for a QOM type */
 DECLARE_INSTANCE_CHECKER(struct PciInferenceDevice, INFERENCEDEV, TYPE_PCI_CUSTOM_DEVICE);
 
@@ -20,7 +116,9 @@ struct ControlBitfields
 	uint32_t start : 1,
 		stop : 1,
 		reset : 1,
-		reserved : 29;
+		dma : 1, /* Job moves its data with the DMA engine instead of the tensor BAR */
+		sg : 1,	 /* Job data are described by the scatter-gather descriptor table */
+		reserved : 27;
 };
 
 struct StatusBitfields
@@ -48,88 +146,2150 @@ struct RegisterSpace
 	union Control control_w1s;				 /* W1S */
 	union Control control_w1c;				 /* W1C */
 	union Status status;					 /* RO  */
-	uint32_t padding[48 / sizeof(uint32_t)]; /* Want to make sizeof(struct RegisterSpace) = 64 bytes */
+	uint64_t dma_src;						 /* RW, IOVA of the input tensor, or its BAR1 offset without DMA */
+	uint64_t dma_dst;						 /* RW, IOVA of the output tensor, or its BAR1 offset without DMA */
+	uint32_t dma_src_len;					 /* RW, input length in bytes */
+	uint32_t dma_dst_len;					 /* RW, output length in bytes */
+	uint64_t sg_table;						 /* RW, IOVA of the scatter-gather descriptor table */
+	uint32_t sg_count;						 /* RW, number of descriptors in the table */
+	uint32_t num_queues;					 /* RO, number of submission queues */
+	uint32_t padding[8 / sizeof(uint32_t)];	 /* Want to make sizeof(struct RegisterSpace) = 64 bytes */
+};
+
+/* Registers of submission queue N, at BAR0 offset (N + 1) * INFERENCE_QUEUE_STRIDE */
+struct QueueRegisterSpace
+{
+	uint32_t doorbell; /* WO, producer index: next entry the driver will fill */
+	uint32_t head;	   /* RO, consumer index: next entry the device will complete */
+	uint64_t base;	   /* RW, IOVA of the ring of struct InferenceSubmission */
+	uint32_t size;	   /* RW, ring entries, writing it empties the queue */
+	union Status status; /* RO, busy while the ring is not empty, error of the last failed job */
+	uint32_t coalesce_count; /* RW, completions per interrupt, 0 or 1 disables coalescing */
+	uint32_t coalesce_usec;	 /* RW, longest delay of a coalesced interrupt, 0 means no limit */
+	uint64_t shadow_tail;	 /* RW, IOVA of a 32-bit copy of the doorbell kept in guest memory */
+	uint64_t cq_base;		 /* RW, IOVA of the ring of struct InferenceCompletion */
+	uint32_t cq_size;		 /* RW, completion ring entries, 0 disables it, writing it empties the ring */
+	uint32_t cq_head;		 /* RW, consumer index: next completion the driver will reap */
+};
+
+/*
+ * Scatter-gather descriptor as it lies in guest memory (little endian), laid
+ * out like a virtqueue descriptor. The chain starts with descriptor 0; readable
+ * buffers are gathered into the input tensor, writable ones receive the output.
+ */
+struct InferenceSgDesc
+{
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+/* Submission queue entry as it lies in guest memory (little endian) */
+struct InferenceSubmission
+{
+	uint16_t id;
+	uint16_t flags;
+	uint32_t model; /* handle of the resident weights the job runs against, 0 for none */
+	uint64_t src;
+	uint64_t dst;
+	uint32_t src_len;
+	uint32_t dst_len;
+	uint64_t sg_table;
+	uint32_t sg_count;
+	uint32_t reserved1[5];
+};
+
+/*
+ * Completion queue entry as the device writes it to guest memory (little
+ * endian). The phase bit of the entries written during the first pass over
+ * the ring is 1, it flips every time the device wraps around, so the driver
+ * finds new completions without reading any register. The ring is full when
+ * the next entry would reach cq_head; the device then stops taking
+ * submissions until the driver reaps some completions.
+ */
+struct InferenceCompletion
+{
+	uint16_t id;	 /* id of the completed submission */
+	uint16_t status; /* INFERENCE_CQE_PHASE | error << INFERENCE_CQE_ERROR_SHIFT */
+	uint32_t reserved;
+	uint64_t exec_ns; /* time the job spent in the backend, including its DMA */
+};
+
+#define INFERENCE_CQE_PHASE 0x1
+#define INFERENCE_CQE_ERROR_SHIFT 1
+
+/*
+ * Activity counters, 64-bit registers at BAR0 offset INFERENCE_STATS_OFFSET
+ * + 8 * index. A submission is a START or a queue entry, a batch counts
+ * once. The counters survive device resets and are updated without locks,
+ * so a driver reading one in two 32-bit halves reads the high half again
+ * to catch a carry in between.
+ */
+enum InferenceStat
+{
+	INFERENCE_STAT_SUBMITTED,
+	INFERENCE_STAT_COMPLETED, /* including failed submissions */
+	INFERENCE_STAT_ERRORS,
+	INFERENCE_STAT_BYTES_IN, /* tensor bytes of the jobs that succeeded */
+	INFERENCE_STAT_BYTES_OUT,
+	INFERENCE_STAT_BUSY_NS, /* run time of the completed submissions, summed over the workers */
+	INFERENCE_STAT_QUEUE_DEPTH, /* histogram, bucket N counts doorbells leaving 2^N to 2^(N+1) - 1 entries */
+	INFERENCE_STAT_COUNT = INFERENCE_STAT_QUEUE_DEPTH + INFERENCE_STATS_DEPTH_BUCKETS,
+};
+
+QEMU_BUILD_BUG_ON(sizeof(struct RegisterSpace) != 64);
+QEMU_BUILD_BUG_ON(INFERENCE_STATS_OFFSET < sizeof(struct RegisterSpace) ||
+				  INFERENCE_STATS_OFFSET + INFERENCE_STAT_COUNT * 8 > INFERENCE_QUEUE_STRIDE);
+QEMU_BUILD_BUG_ON(sizeof(struct InferenceSubmission) != 64);
+QEMU_BUILD_BUG_ON(sizeof(struct InferenceCompletion) != 16);
+
+/* Snapshot of the registers taken at START, the worker never reads regspace */
+struct InferenceJob
+{
+	uint32_t seq;
+	uint16_t id; /* Submission id, reported in the completion entry */
+	int64_t submit_vt; /* QEMU_CLOCK_VIRTUAL of the START or of the doorbell, the timing model counts from it */
+	uint32_t model;	   /* resident weights, or the handle a load fills */
+	bool load;
+	bool dma; /* Data live in guest memory, either contiguous or scattered */
+	bool sg;
+	dma_addr_t src;
+	dma_addr_t dst;
+	uint32_t src_len;
+	uint32_t dst_len;
+	dma_addr_t sg_table;
+	uint32_t sg_count;
+
+	QEMUSGList in_sg;
+	QEMUSGList out_sg;
+	uint8_t *input;
+	size_t input_len;
+	uint8_t *output;
+	size_t output_len;
+	bool input_mapped; /* input/output point into guest memory instead of host copies */
+	bool output_mapped;
+	bool submitted; /* the backend took the buffers, so it may have written the output */
+	struct InferenceWeights *weights; /* held from submission until the buffers are dropped */
+	uint8_t error;
+};
+
+/*
+ * Weights of a resident model. The backend gets them along with the input
+ * of every job naming the model, so that the guest only transfers the
+ * activations. They are kept in weights_mem, a RAM region of the device
+ * that migrates like guest memory. Entries are evicted in LRU order when a
+ * load needs room; one that jobs still use leaves the cache at once but
+ * keeps its bytes of weights_mem until they are done with it.
+ */
+struct InferenceWeights
+{
+	uint32_t model;
+	uint32_t len;
+	uint64_t offset; /* in weights_mem */
+	uint8_t *data;	 /* host address of offset */
+	uint32_t users;	 /* jobs running against the weights, or the load filling them */
+	bool evicted;	 /* no longer in the cache, freed by the last user */
+	QTAILQ_ENTRY(InferenceWeights) lru;
+	QTAILQ_ENTRY(InferenceWeights) extents;
+};
+
+/* A thread running the legacy START job, or dispatching the jobs of one queue to the pool */
+struct InferenceWorker
+{
+	QemuThread thread;
+	QemuMutex mutex; /* protects everything the thread shares with MMIO handlers */
+	QemuCond cond;
+	uint32_t seq; /* bumped to cancel the running job */
+	bool stopping;
+
+	/* While the VM is stopped the running job is cancelled and retried on resume */
+	bool paused;
+	uint32_t running;	/* jobs taken and not finished yet, by this thread or the pool */
+	QemuCond idle_cond; /* signalled when running drops */
+};
+
+enum InferencePoolJobState
+{
+	INFERENCE_POOL_JOB_QUEUED,	/* fetched, waiting in a pool deque */
+	INFERENCE_POOL_JOB_RUNNING,
+	INFERENCE_POOL_JOB_DONE,
+};
+
+/* A queue entry in flight, owned by the in-flight list of its queue */
+struct InferencePoolJob
+{
+	struct InferenceJob job;
+	struct InferenceQueue *queue;
+	bool batch;
+	/* The fields below are protected by queue->worker.mutex */
+	enum InferencePoolJobState state;
+	bool finished; /* false if the job was interrupted by a VM stop */
+	bool orphan;   /* dropped from the in-flight list, freed by the thread that holds it */
+	int64_t submit_ns; /* QEMU_CLOCK_REALTIME of the doorbell that made the entry available */
+	int64_t start_ns;  /* 0 if the entry could not be fetched */
+	int64_t exec_ns;
+	int64_t deadline; /* QEMU_CLOCK_VIRTUAL at which the modelled accelerator finishes it, 0 if not computed yet */
+	/* A batch entry runs as one pool job per member, the last one to finish completes it */
+	uint32_t pending_members; /* protected by queue->worker.mutex once the members are pushed */
+	uint32_t error_member;	  /* index of the first member that failed, UINT32_MAX if none */
+	bool interrupted;		  /* a member was cancelled, the batch runs again as a whole */
+	struct InferencePoolJob *parent; /* of a member, which has no entry in the in-flight list */
+	uint32_t member;				 /* index in the batch */
+};
+
+/* Stages of the latency of a queue entry, each one has its own histogram */
+enum InferenceLatencyStage
+{
+	INFERENCE_LATENCY_SUBMIT_TO_START,
+	INFERENCE_LATENCY_START_TO_FINISH,
+	INFERENCE_LATENCY_FINISH_TO_IRQ, /* coalescing included */
+	INFERENCE_LATENCY_COUNT,
+};
+
+/* A thread of the pool that runs the jobs of all queues */
+struct InferencePoolWorker
+{
+	struct PciInferenceDevice *device;
+	uint32_t index;
+	QemuThread thread;
+	PtrRingMP jobs; /* deque of struct InferencePoolJob, idle workers steal from it */
+};
+
+struct InferenceQueue
+{
+	struct PciInferenceDevice *device;
+	uint32_t index;
+	struct InferenceWorker worker;
+	struct QueueRegisterSpace regs; /* doorbell holds the producer index */
+	uint32_t fetched;	/* next entry the dispatcher fetches, between head and doorbell */
+	GQueue inflight;	/* struct InferencePoolJob from head to fetched, in ring order */
+	struct InferencePoolJob *fence; /* load in flight, nothing past it is fetched until it retires */
+	uint32_t outstanding; /* jobs allocated, in flight or orphans, bounds what sits in the pool deques */
+	uint32_t members_queued; /* batch members in the pool deques, atomic, at most INFERENCE_BATCH_MAX_JOBS */
+	/* Completions are signalled from the device AioContext, see inference_aio_context() */
+	QEMUBH *irq_bh;		 /* raises the MSI-X vectors */
+	uint32_t irq_pending; /* INFERENCE_IRQ_*, protected by worker.mutex */
+	uint32_t irq_completions; /* completions not yet seen by irq_bh, protected by worker.mutex */
+	QEMUTimer coalesce_timer;
+	QEMUTimer model_timer; /* retires the head entry once the timing model lets it complete */
+	int64_t model_retired; /* deadline of the last retired entry, the modelled accelerator runs one at a time */
+	uint32_t coalesced; /* completions whose interrupt is held back, protected by worker.mutex */
+	uint32_t cq_tail;	/* next completion entry the device writes, protected by worker.mutex */
+	uint16_t cq_phase;	/* phase bit of the entries written in this pass over the ring */
+
+	/* Latency accounting, protected by worker.mutex and kept across resets */
+	int64_t *submit_ns;	/* doorbell time of every ring entry */
+	int64_t *submit_vt;	/* same in QEMU_CLOCK_VIRTUAL, for the timing model */
+	GArray *irq_wait;	/* finish time of the completions whose interrupt is held back */
+	struct qdist latency[INFERENCE_LATENCY_COUNT]; /* ns, see inference_latency_record() */
+
+	/*
+	 * With a shadow tail the doorbell is an ioeventfd: KVM only signals the
+	 * notifier, the device IOThread then reads the producer index from guest
+	 * memory. Only touched under the BQL.
+	 */
+	EventNotifier notifier;
+	bool ioeventfd_enabled;
 };
 
 struct PciInferenceDevice
 {
 	PCIDevice pdev;
-	MemoryRegion mmio_bar0; /* register space */
-	MemoryRegion mmio_bar1; /* input data */
-	MemoryRegion mmio_bar2; /* output data */
+	MemoryRegion mmio_bar0;	 /* register space */
+	MemoryRegion tensor_mem; /* RAM behind BAR1 */
 	struct RegisterSpace regspace;
-	uint8_t input_data[4096];
-	uint8_t output_data[4096];
+	uint64_t mem_size;
+
+	/* Inference jobs run on worker threads, never on the vCPU thread */
+	struct InferenceWorker legacy; /* START job, seq is bumped by every START, STOP and RESET */
+	QEMUBH *done_bh;			   /* completes a finished job under the BQL */
+	struct InferenceJob job;	   /* next job for the worker */
+	uint32_t job_done_seq;		   /* seq of the last job the worker finished */
+	uint8_t job_done_error;
+	int64_t job_done_deadline;	   /* QEMU_CLOCK_VIRTUAL at which the timing model completes it */
+	QEMUTimer job_timer;		   /* fires at job_done_deadline */
+	bool job_pending;
+
+	uint32_t num_queues;
+	struct InferenceQueue *queues;
+
+	uint32_t pool_size; /* 0 means one worker per queue */
+	struct InferencePoolWorker *pool;
+	QemuSemaphore pool_sem; /* posted once per job pushed to a deque, and to stop the workers */
+	bool pool_stopping;
+
+	bool ioeventfd;
+	IOThread *iothread;			 /* user provided, consumes doorbells and signals completions */
+	IOThread *internal_iothread; /* created for the ioeventfds when no iothread is given */
+
+	/* Host placement, best matched with the guest memory the jobs DMA to */
+	uint32_t host_node;			  /* NUMA node of the tensor memory */
+	ThreadContext *thread_context; /* creates the worker threads with its CPU affinity */
+
+	/* Resident models, protected by weights_lock */
+	uint64_t weight_cache_size;
+	MemoryRegion weights_mem;						 /* holds the weights, weight_cache_size bytes */
+	QemuMutex weights_lock;
+	GHashTable *weights;							 /* model handle -> struct InferenceWeights */
+	QTAILQ_HEAD(, InferenceWeights) weights_lru;	 /* least recently used first */
+	QTAILQ_HEAD(, InferenceWeights) weights_extents; /* entries holding bytes of weights_mem, by offset */
+
+	InferenceBackend *backend;	 /* user provided, runs the jobs */
+	Object *default_backend;	 /* null backend otherwise, the job duration then comes from the timing model */
+
+	/*
+	 * Timing model of the emulated accelerator, see inference_model_latency().
+	 * Completions are held back until QEMU_CLOCK_VIRTUAL reaches the modelled
+	 * end of the job. A job the backend finishes later completes when it is
+	 * done, nothing waits for it, so the timing the guest sees is only
+	 * deterministic while the backend keeps up with the model, e.g. with the
+	 * null backend. A zero clock disables the model.
+	 */
+	uint32_t model_clock_mhz;
+	uint32_t model_ops_per_cycle;
+	uint32_t model_ops_per_byte;   /* work per input byte */
+	uint32_t model_bandwidth_mbps; /* MB/s of tensor traffic, 0 means unlimited */
+	uint64_t model_overhead_ns;	   /* fixed cost of every job */
+
+	VMChangeStateEntry *vmstate_change;
+
+	Stat64 stats[INFERENCE_STAT_COUNT]; /* enum InferenceStat, not migrated */
 };
 
-static void start_inference(void)
-{
-	/* TODO: Add inference logic */
-	sleep(2);
-	printf("Start inference\n");
-	return;
+static InferenceBackend *inference_backend(struct PciInferenceDevice *device)
+{
+	return device->backend ? device->backend : INFERENCE_BACKEND(device->default_backend);
+}
+
+/*
+ * Duration of a job on the modelled accelerator: the fixed overhead plus
+ * the longer of its compute time and of its tensor transfer time, like a
+ * roofline. A batch is timed as one job over the data of its jobs.
+ */
+static int64_t inference_model_latency(struct PciInferenceDevice *device, const struct InferenceJob *job)
+{
+	uint64_t cycles = DIV_ROUND_UP((uint64_t)job->input_len * device->model_ops_per_byte, device->model_ops_per_cycle);
+	uint64_t compute_ns = job->load ? 0 : muldiv64(cycles, 1000, device->model_clock_mhz);
+	uint64_t transfer_ns = 0;
+
+	if (device->model_bandwidth_mbps != 0)
+	{
+		transfer_ns = muldiv64(job->input_len + job->output_len, 1000, device->model_bandwidth_mbps);
+	}
+	return device->model_overhead_ns + MAX(compute_ns, transfer_ns);
+}
+
+/* Accounts @count new submissions, @depth is the queue occupancy they leave or 0 for START */
+static void inference_stats_submit(struct PciInferenceDevice *device, uint32_t count, uint32_t depth)
+{
+	stat64_add(&device->stats[INFERENCE_STAT_SUBMITTED], count);
+	if (depth != 0)
+	{
+		uint32_t bucket = MIN(31 - clz32(depth), INFERENCE_STATS_DEPTH_BUCKETS - 1);
+
+		stat64_add(&device->stats[INFERENCE_STAT_QUEUE_DEPTH + bucket], 1);
+	}
+}
+
+/* Accounts a completed submission, from any thread */
+static void inference_stats_complete(struct PciInferenceDevice *device, const struct InferenceJob *job,
+									 int64_t exec_ns)
+{
+	stat64_add(&device->stats[INFERENCE_STAT_COMPLETED], 1);
+	stat64_add(&device->stats[INFERENCE_STAT_BUSY_NS], exec_ns);
+	if (job->error != INFERENCE_ERROR_NONE)
+	{
+		stat64_add(&device->stats[INFERENCE_STAT_ERRORS], 1);
+		return;
+	}
+	stat64_add(&device->stats[INFERENCE_STAT_BYTES_IN], job->input_len);
+	stat64_add(&device->stats[INFERENCE_STAT_BYTES_OUT], job->output_len);
+}
+
+/* Called with weights_lock held */
+static void inference_weights_free(struct PciInferenceDevice *device, struct InferenceWeights *w)
+{
+	QTAILQ_REMOVE(&device->weights_extents, w, extents);
+	g_free(w);
+}
+
+/* Drops @w from the cache, called with weights_lock held */
+static void inference_weights_evict(struct PciInferenceDevice *device, struct InferenceWeights *w)
+{
+	g_hash_table_remove(device->weights, GUINT_TO_POINTER(w->model));
+	QTAILQ_REMOVE(&device->weights_lru, w, lru);
+	w->evicted = true;
+	if (w->users == 0)
+	{
+		inference_weights_free(device, w);
+	}
+}
+
+/* Adds @w to the entries holding weights_mem, called with weights_lock held */
+static void inference_weights_place(struct PciInferenceDevice *device, struct InferenceWeights *w)
+{
+	struct InferenceWeights *next;
+
+	w->data = (uint8_t *)memory_region_get_ram_ptr(&device->weights_mem) + w->offset;
+	QTAILQ_FOREACH(next, &device->weights_extents, extents)
+	{
+		if (next->offset > w->offset)
+		{
+			QTAILQ_INSERT_BEFORE(next, w, extents);
+			return;
+		}
+	}
+	QTAILQ_INSERT_TAIL(&device->weights_extents, w, extents);
+}
+
+/* Finds @len free bytes of weights_mem, first fit, called with weights_lock held */
+static bool inference_weights_hole(struct PciInferenceDevice *device, uint32_t len, uint64_t *offset)
+{
+	struct InferenceWeights *w;
+	uint64_t start = 0;
+
+	QTAILQ_FOREACH(w, &device->weights_extents, extents)
+	{
+		if (w->offset >= start && w->offset - start >= len)
+		{
+			break;
+		}
+		/* A migration stream may place entries over each other */
+		start = MAX(start, w->offset + w->len);
+	}
+	*offset = start;
+	return device->weight_cache_size - start >= len;
+}
+
+/*
+ * Reserves @len bytes of weights_mem for a load of @model, evicting @model
+ * and then older models until they fit. The weights are filled outside the
+ * lock and made resident by inference_weights_commit(), or dropped with
+ * inference_weights_put(). Returns NULL if weights that jobs still run
+ * against are in the way.
+ */
+static struct InferenceWeights *inference_weights_reserve(struct PciInferenceDevice *device, uint32_t model,
+														  uint32_t len)
+{
+	struct InferenceWeights *w;
+	uint64_t offset;
+
+	QEMU_LOCK_GUARD(&device->weights_lock);
+
+	w = g_hash_table_lookup(device->weights, GUINT_TO_POINTER(model));
+	if (w)
+	{
+		inference_weights_evict(device, w);
+	}
+	while (!inference_weights_hole(device, len, &offset))
+	{
+		if (QTAILQ_EMPTY(&device->weights_lru))
+		{
+			return NULL;
+		}
+		inference_weights_evict(device, QTAILQ_FIRST(&device->weights_lru));
+	}
+
+	/* Not in the cache yet, the load is its only user */
+	w = g_new0(struct InferenceWeights, 1);
+	w->model = model;
+	w->len = len;
+	w->offset = offset;
+	w->users = 1;
+	w->evicted = true;
+	inference_weights_place(device, w);
+	return w;
+}
+
+/* Makes the weights a load filled those of its model */
+static void inference_weights_commit(struct PciInferenceDevice *device, struct InferenceWeights *w)
+{
+	struct InferenceWeights *old;
+
+	memory_region_set_dirty(&device->weights_mem, w->offset, w->len);
+
+	QEMU_LOCK_GUARD(&device->weights_lock);
+
+	/* Another queue may have loaded the model meanwhile, the last load wins */
+	old = g_hash_table_lookup(device->weights, GUINT_TO_POINTER(w->model));
+	if (old)
+	{
+		inference_weights_evict(device, old);
+	}
+	w->users = 0;
+	w->evicted = false;
+	g_hash_table_insert(device->weights, GUINT_TO_POINTER(w->model), w);
+	QTAILQ_INSERT_TAIL(&device->weights_lru, w, lru);
+}
+
+/* Returns the weights of @model for a job, or NULL if it is not resident */
+static struct InferenceWeights *inference_weights_get(struct PciInferenceDevice *device, uint32_t model)
+{
+	struct InferenceWeights *w;
+
+	QEMU_LOCK_GUARD(&device->weights_lock);
+
+	w = g_hash_table_lookup(device->weights, GUINT_TO_POINTER(model));
+	if (w)
+	{
+		w->users++;
+		QTAILQ_REMOVE(&device->weights_lru, w, lru);
+		QTAILQ_INSERT_TAIL(&device->weights_lru, w, lru);
+	}
+	return w;
+}
+
+static void inference_weights_put(struct PciInferenceDevice *device, struct InferenceWeights *w)
+{
+	QEMU_LOCK_GUARD(&device->weights_lock);
+
+	if (--w->users == 0 && w->evicted)
+	{
+		inference_weights_free(device, w);
+	}
+}
+
+/* Empties the cache, the weights jobs still use are freed after them */
+static void inference_weights_flush(struct PciInferenceDevice *device)
+{
+	QEMU_LOCK_GUARD(&device->weights_lock);
+
+	while (!QTAILQ_EMPTY(&device->weights_lru))
+	{
+		inference_weights_evict(device, QTAILQ_FIRST(&device->weights_lru));
+	}
+}
+
+/*
+ * Adds a sample to a latency histogram. Like an HDR histogram, samples are
+ * rounded down to 4 significant bits, so that the qdist keeps a few entries
+ * per power of two whatever the spread while percentiles stay within 12.5%.
+ */
+static void inference_latency_record(struct qdist *dist, int64_t ns)
+{
+	int shift;
+
+	if (ns <= 0)
+	{
+		qdist_inc(dist, 0);
+		return;
+	}
+	shift = MAX(63 - clz64(ns) - 3, 0);
+	qdist_inc(dist, (double)(ns >> shift << shift));
+}
+
+/* Accounts the interrupt about to signal the held back completions, called with queue->worker.mutex held */
+static void inference_queue_irq_latency(struct InferenceQueue *queue)
+{
+	int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+	for (guint i = 0; i < queue->irq_wait->len; i++)
+	{
+		inference_latency_record(&queue->latency[INFERENCE_LATENCY_FINISH_TO_IRQ],
+								 now - g_array_index(queue->irq_wait, int64_t, i));
+	}
+	g_array_set_size(queue->irq_wait, 0);
+}
+
+/* Queue doorbells, completion interrupts and coalescing timers run in this context */
+static AioContext *inference_aio_context(struct PciInferenceDevice *device)
+{
+	if (device->iothread)
+	{
+		return iothread_get_aio_context(device->iothread);
+	}
+	if (device->internal_iothread)
+	{
+		return iothread_get_aio_context(device->internal_iothread);
+	}
+	return qemu_get_aio_context();
+}
+
+/* Called from the main loop or from the device IOThread */
+static void inference_raise_irq(struct PciInferenceDevice *device, uint32_t vector, uint32_t irq)
+{
+	/* MSI-X state belongs to the BQL, this is the only place an IOThread takes it */
+	BQL_LOCK_GUARD();
+
+	trace_pci_inference_irq(vector, irq);
+	if (!msix_enabled(&device->pdev))
+	{
+		return;
+	}
+
+	if (irq & INFERENCE_IRQ_DONE)
+	{
+		msix_notify(&device->pdev, vector);
+	}
+	if (irq & INFERENCE_IRQ_ERROR)
+	{
+		msix_notify(&device->pdev, device->num_queues);
+	}
+}
+
+static void inference_queue_coalesce_timeout(void *opaque)
+{
+	struct InferenceQueue *queue = opaque;
+	bool fire;
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	fire = queue->coalesced != 0;
+	queue->coalesced = 0;
+	if (fire)
+	{
+		inference_queue_irq_latency(queue);
+	}
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	if (fire)
+	{
+		inference_raise_irq(queue->device, queue->index, INFERENCE_IRQ_DONE);
+	}
+}
+
+/* Holds completion interrupts back until enough of them accumulate or the delay expires */
+static void inference_queue_irq(void *opaque)
+{
+	struct InferenceQueue *queue = opaque;
+	uint32_t irq, max_usec;
+	bool fire = false, arm = false;
+
+	/* Completions stay pending while the VM is stopped, they migrate with the queue */
+	if (!runstate_is_running())
+	{
+		return;
+	}
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	irq = queue->irq_pending;
+	queue->irq_pending = 0;
+	if (irq & INFERENCE_IRQ_DONE)
+	{
+		queue->coalesced += queue->irq_completions;
+		if (queue->regs.coalesce_count <= 1 || queue->coalesced >= queue->regs.coalesce_count)
+		{
+			fire = true;
+			queue->coalesced = 0;
+			inference_queue_irq_latency(queue);
+		}
+		else
+		{
+			arm = queue->regs.coalesce_usec != 0;
+		}
+	}
+	queue->irq_completions = 0;
+	max_usec = queue->regs.coalesce_usec;
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	if (fire)
+	{
+		timer_del(&queue->coalesce_timer);
+	}
+	else if (arm && !timer_pending(&queue->coalesce_timer))
+	{
+		timer_mod(&queue->coalesce_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)max_usec * SCALE_US);
+	}
+
+	/* Errors are never delayed */
+	inference_raise_irq(queue->device, queue->index, (irq & INFERENCE_IRQ_ERROR) | (fire ? INFERENCE_IRQ_DONE : 0));
+}
+
+/* Hands the job buffers to the backend, returns false and fails the job if it refused them */
+static bool inference_job_submit(struct PciInferenceDevice *device, struct InferenceJob *job, InferenceRequest *req)
+{
+	Error *local_err = NULL;
+
+	/* Released with the job buffers by inference_dma_complete() */
+	if (job->model != 0 && !job->weights)
+	{
+		job->weights = inference_weights_get(device, job->model);
+		if (!job->weights)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: model %u is not loaded\n", job->model);
+			job->error = INFERENCE_ERROR_MODEL;
+			return false;
+		}
+	}
+
+	*req = (InferenceRequest){
+		.input = job->input,
+		.input_len = job->input_len,
+		.output = job->output,
+		.output_len = job->output_len,
+		.weights = job->weights ? job->weights->data : NULL,
+		.weights_len = job->weights ? job->weights->len : 0,
+	};
+
+	trace_pci_inference_job_submit(job, job->input_len, job->output_len);
+
+	if (inference_backend_submit(inference_backend(device), req, &local_err) < 0)
+	{
+		error_report_err(local_err);
+		job->error = INFERENCE_ERROR_BACKEND;
+		return false;
+	}
+	job->submitted = true;
+	return true;
+}
+
+/* Waits for a submitted job, returns false if it was cancelled meanwhile */
+static bool inference_job_wait(struct PciInferenceDevice *device, struct InferenceWorker *worker,
+							   struct InferenceJob *job, InferenceRequest *req)
+{
+	InferenceBackend *backend = inference_backend(device);
+	int ret;
+
+	/* Poll in slices so that STOP and RESET interrupt the job */
+	while ((ret = inference_backend_poll(backend, req, INFERENCE_POLL_NS)) == -EINPROGRESS)
+	{
+		bool cancelled;
+
+		qemu_mutex_lock(&worker->mutex);
+		cancelled = worker->seq != job->seq || worker->stopping || worker->paused;
+		qemu_mutex_unlock(&worker->mutex);
+
+		if (cancelled)
+		{
+			trace_pci_inference_job_cancel(job);
+			inference_backend_cancel(backend, req);
+			return false;
+		}
+	}
+
+	trace_pci_inference_job_finish(job, ret);
+	if (ret < 0)
+	{
+		job->error = INFERENCE_ERROR_BACKEND;
+	}
+	return true;
+}
+
+/* Called from a worker thread, returns false if the job was cancelled */
+static bool start_inference(struct PciInferenceDevice *device, struct InferenceWorker *worker,
+							struct InferenceJob *job)
+{
+	InferenceRequest req;
+
+	return !inference_job_submit(device, job, &req) || inference_job_wait(device, worker, job, &req);
+}
+
+/* Drops the running or pending job, the worker notices it by seq */
+static void cancel_inference(struct PciInferenceDevice *device)
+{
+	qemu_mutex_lock(&device->legacy.mutex);
+	device->legacy.seq++;
+	device->job_pending = false;
+	qemu_cond_broadcast(&device->legacy.cond);
+	qemu_mutex_unlock(&device->legacy.mutex);
+}
+
+/* Publishes a new producer index, called with queue->worker.mutex held */
+static void inference_queue_kick(struct InferenceQueue *queue, uint64_t tail)
+{
+	uint32_t size = queue->regs.size;
+	uint32_t added;
+
+	if (size == 0 || tail >= size)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u doorbell 0x%" PRIx64 " out of ring\n",
+					  queue->index, tail);
+		return;
+	}
+
+	added = (tail + size - queue->regs.doorbell) % size;
+	if (added != 0)
+	{
+		int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+		int64_t now_vt = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+		inference_stats_submit(queue->device, added, (tail + size - queue->regs.head) % size);
+		for (uint32_t i = queue->regs.doorbell; i != tail; i = (i + 1) % size)
+		{
+			queue->submit_ns[i] = now;
+			queue->submit_vt[i] = now_vt;
+		}
+	}
+	queue->regs.doorbell = tail;
+	qemu_cond_signal(&queue->worker.cond);
+}
+
+/* Runs in the device AioContext, without the BQL */
+static void inference_queue_notify(EventNotifier *e)
+{
+	struct InferenceQueue *queue = container_of(e, struct InferenceQueue, notifier);
+	uint64_t addr;
+	uint32_t tail;
+
+	if (!event_notifier_test_and_clear(e))
+	{
+		return;
+	}
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	addr = queue->regs.shadow_tail;
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	if (ldl_le_pci_dma(&queue->device->pdev, addr, &tail, INFERENCE_DMA_ATTRS) != MEMTX_OK)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u shadow tail read from 0x%" PRIx64 " failed\n",
+					  queue->index, addr);
+		return;
+	}
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	inference_queue_kick(queue, tail);
+	qemu_mutex_unlock(&queue->worker.mutex);
+}
+
+/* Routes the doorbell to an ioeventfd while the guest provides a shadow tail */
+static void inference_queue_update_ioeventfd(struct InferenceQueue *queue)
+{
+	struct PciInferenceDevice *device = queue->device;
+	hwaddr doorbell = (queue->index + 1) * INFERENCE_QUEUE_STRIDE + offsetof(struct QueueRegisterSpace, doorbell);
+	AioContext *ctx;
+	bool enable;
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	enable = device->ioeventfd && queue->regs.shadow_tail != 0;
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	if (enable == queue->ioeventfd_enabled)
+	{
+		return;
+	}
+
+	ctx = inference_aio_context(device);
+
+	if (enable)
+	{
+		if (event_notifier_init(&queue->notifier, 0) < 0)
+		{
+			qemu_log_mask(LOG_UNIMP, "pci-inference-device: queue %u falls back to MMIO doorbell\n",
+						  queue->index);
+			return;
+		}
+		aio_set_event_notifier(ctx, &queue->notifier, inference_queue_notify, NULL, NULL);
+		memory_region_add_eventfd(&device->mmio_bar0, doorbell, 4, false, 0, &queue->notifier);
+	}
+	else
+	{
+		memory_region_del_eventfd(&device->mmio_bar0, doorbell, 4, false, 0, &queue->notifier);
+		aio_set_event_notifier(ctx, &queue->notifier, NULL, NULL, NULL);
+		event_notifier_cleanup(&queue->notifier);
+	}
+	queue->ioeventfd_enabled = enable;
+}
+
+/* Called with queue->worker.mutex held */
+static void inference_pool_job_free(struct InferencePoolJob *pjob)
+{
+	struct InferenceQueue *queue = pjob->queue;
+
+	queue->outstanding--;
+	g_free(pjob);
+
+	/* The dispatcher may wait for room */
+	qemu_cond_broadcast(&queue->worker.cond);
+}
+
+/*
+ * Forgets the jobs in flight so that the ring is fetched again from head,
+ * called with queue->worker.mutex held. Jobs still queued in the pool or
+ * running are freed by the thread that holds them.
+ */
+static void inference_queue_drop_inflight(struct InferenceQueue *queue)
+{
+	struct InferencePoolJob *pjob;
+
+	while ((pjob = g_queue_pop_head(&queue->inflight)))
+	{
+		if (pjob->state == INFERENCE_POOL_JOB_DONE)
+		{
+			inference_pool_job_free(pjob);
+		}
+		else
+		{
+			pjob->orphan = true;
+		}
+	}
+	queue->fence = NULL;
+	queue->fetched = queue->regs.head;
+}
+
+/* Drops the jobs of the queue and empties its ring */
+static void inference_queue_reset(struct InferenceQueue *queue)
+{
+	qemu_mutex_lock(&queue->worker.mutex);
+	queue->worker.seq++;
+	memset(&queue->regs, 0, sizeof(queue->regs));
+	inference_queue_drop_inflight(queue);
+	queue->cq_tail = 0;
+	queue->cq_phase = INFERENCE_CQE_PHASE;
+	queue->irq_pending = 0;
+	queue->irq_completions = 0;
+	queue->coalesced = 0;
+	queue->model_retired = 0;
+	g_array_set_size(queue->irq_wait, 0);
+	qemu_cond_broadcast(&queue->worker.cond);
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	timer_del(&queue->coalesce_timer);
+	timer_del(&queue->model_timer);
+	inference_queue_update_ioeventfd(queue);
+}
+
+static MemTxResult inference_dma_read(struct PciInferenceDevice *device, dma_addr_t addr, void *buf, dma_addr_t len)
+{
+	return pci_dma_rw(&device->pdev, addr, buf, len, DMA_DIRECTION_TO_DEVICE, INFERENCE_DMA_ATTRS);
+}
+
+static MemTxResult inference_dma_write(struct PciInferenceDevice *device, dma_addr_t addr, const void *buf,
+									   dma_addr_t len)
+{
+	return pci_dma_rw(&device->pdev, addr, (void *)buf, len, DMA_DIRECTION_FROM_DEVICE, INFERENCE_DMA_ATTRS);
+}
+
+/* Walks the descriptor chain and sorts its buffers into job->in_sg and job->out_sg */
+static bool inference_sg_walk(struct PciInferenceDevice *device, struct InferenceJob *job)
+{
+	uint32_t idx = 0;
+
+	if (job->sg_count == 0 || job->sg_count > INFERENCE_SG_MAX_DESC)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: bad descriptor count %u\n", job->sg_count);
+		return false;
+	}
+
+	/* A well formed chain visits every descriptor at most once */
+	for (uint32_t visited = 0; visited < job->sg_count; visited++)
+	{
+		struct InferenceSgDesc desc;
+		dma_addr_t addr = job->sg_table + idx * sizeof(desc);
+
+		if (inference_dma_read(device, addr, &desc, sizeof(desc)) != MEMTX_OK)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: descriptor read from 0x%" PRIx64 " failed\n",
+						  addr);
+			return false;
+		}
+
+		desc.addr = le64_to_cpu(desc.addr);
+		desc.len = le32_to_cpu(desc.len);
+		desc.flags = le16_to_cpu(desc.flags);
+		desc.next = le16_to_cpu(desc.next);
+
+		if (desc.len != 0)
+		{
+			qemu_sglist_add(desc.flags & INFERENCE_SG_DESC_F_WRITE ? &job->out_sg : &job->in_sg,
+							desc.addr, desc.len);
+		}
+
+		if (!(desc.flags & INFERENCE_SG_DESC_F_NEXT))
+		{
+			return true;
+		}
+
+		idx = desc.next;
+		if (idx >= job->sg_count)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: descriptor %u out of table\n", idx);
+			return false;
+		}
+	}
+
+	qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: descriptor chain loops\n");
+	return false;
+}
+
+/* Maps a single-segment buffer of guest RAM, returns NULL if it has to be copied */
+static uint8_t *inference_dma_map(struct PciInferenceDevice *device, QEMUSGList *sg, DMADirection dir)
+{
+	dma_addr_t len = sg->size;
+	ram_addr_t offset;
+	uint8_t *ptr;
+
+	if (sg->nsg != 1)
+	{
+		return NULL;
+	}
+
+	/* Anything else gets a bounce buffer, which the unmap would write back through MMIO */
+	ptr = dma_memory_map(pci_get_address_space(&device->pdev), sg->sg[0].base, &len, dir, INFERENCE_DMA_ATTRS);
+	if (ptr && (len < sg->size || !memory_region_from_host(ptr, &offset)))
+	{
+		pci_dma_unmap(&device->pdev, ptr, len, dir, 0);
+		return NULL;
+	}
+	return ptr;
+}
+
+/* Pulls the input tensor from guest memory into a host buffer, or maps it */
+static void inference_dma_prepare(struct PciInferenceDevice *device, struct InferenceJob *job)
+{
+	pci_dma_sglist_init(&job->in_sg, &device->pdev, job->sg ? 4 : 1);
+	pci_dma_sglist_init(&job->out_sg, &device->pdev, job->sg ? 4 : 1);
+
+	if (job->sg)
+	{
+		if (!inference_sg_walk(device, job))
+		{
+			job->error = INFERENCE_ERROR_DESC;
+			return;
+		}
+	}
+	else
+	{
+		qemu_sglist_add(&job->in_sg, job->src, job->src_len);
+		qemu_sglist_add(&job->out_sg, job->dst, job->dst_len);
+	}
+
+	if (job->in_sg.size == 0 || job->in_sg.size > INFERENCE_DMA_MAX_LEN ||
+		job->out_sg.size == 0 || job->out_sg.size > INFERENCE_DMA_MAX_LEN)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: bad DMA length in 0x%" PRIx64 " out 0x%" PRIx64 "\n",
+					  job->in_sg.size, job->out_sg.size);
+		job->error = INFERENCE_ERROR_LENGTH;
+		return;
+	}
+
+	job->input_len = job->in_sg.size;
+	job->output_len = job->out_sg.size;
+
+	/* Contiguous buffers are handed to the backend in place, without copies */
+	job->input = inference_dma_map(device, &job->in_sg, DMA_DIRECTION_TO_DEVICE);
+	job->input_mapped = job->input != NULL;
+	job->output = inference_dma_map(device, &job->out_sg, DMA_DIRECTION_FROM_DEVICE);
+	job->output_mapped = job->output != NULL;
+	trace_pci_inference_dma_prepare(job, job->input_len, job->output_len, job->input_mapped, job->output_mapped);
+
+	if (!job->output_mapped)
+	{
+		job->output = g_malloc0(job->output_len);
+	}
+	if (job->input_mapped)
+	{
+		return;
+	}
+
+	job->input = g_malloc(job->input_len);
+	/* dma_buf_write() moves data towards the device, i.e. out of guest memory */
+	if (dma_buf_write(job->input, job->input_len, NULL, &job->in_sg, INFERENCE_DMA_ATTRS) != MEMTX_OK)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: DMA read of the input failed\n");
+		job->error = INFERENCE_ERROR_DMA;
+	}
+}
+
+/* Pushes the output tensor back to guest memory and drops the host buffers */
+static void inference_dma_complete(struct PciInferenceDevice *device, struct InferenceJob *job, bool write)
+{
+	if (job->output_mapped)
+	{
+		/*
+		 * The backend may have written part of it even if the job failed.
+		 * Unmapping with the whole length also marks it dirty for migration,
+		 * like dma_buf_read() does for copied outputs; nothing is dirty if
+		 * the job failed before reaching the backend.
+		 */
+		pci_dma_unmap(&device->pdev, job->output, job->output_len, DMA_DIRECTION_FROM_DEVICE,
+					  job->submitted ? job->output_len : 0);
+	}
+	else
+	{
+		if (write && dma_buf_read(job->output, job->output_len, NULL, &job->out_sg, INFERENCE_DMA_ATTRS) != MEMTX_OK)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: DMA write of the output failed\n");
+			job->error = INFERENCE_ERROR_DMA;
+		}
+		g_free(job->output);
+	}
+
+	if (job->input_mapped)
+	{
+		pci_dma_unmap(&device->pdev, job->input, job->input_len, DMA_DIRECTION_TO_DEVICE, 0);
+	}
+	else
+	{
+		g_free(job->input);
+	}
+
+	if (job->weights)
+	{
+		inference_weights_put(device, job->weights);
+		job->weights = NULL;
+	}
+
+	trace_pci_inference_dma_complete(job, write, job->error);
+	qemu_sglist_destroy(&job->in_sg);
+	qemu_sglist_destroy(&job->out_sg);
+	job->input = NULL;
+	job->output = NULL;
+	job->input_mapped = false;
+	job->output_mapped = false;
+	job->submitted = false;
+}
+
+/* Copies the weights of a load entry from guest memory into the cache, a failed load leaves the model unloaded */
+static void inference_run_load(struct PciInferenceDevice *device, struct InferenceJob *job)
+{
+	struct InferenceWeights *w;
+
+	pci_dma_sglist_init(&job->in_sg, &device->pdev, job->sg ? 4 : 1);
+	pci_dma_sglist_init(&job->out_sg, &device->pdev, 1);
+
+	if (job->model == 0)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: load without a model handle\n");
+		job->error = INFERENCE_ERROR_MODEL;
+		goto out;
+	}
+	if (job->sg)
+	{
+		if (!inference_sg_walk(device, job))
+		{
+			job->error = INFERENCE_ERROR_DESC;
+			goto out;
+		}
+	}
+	else
+	{
+		qemu_sglist_add(&job->in_sg, job->src, job->src_len);
+	}
+	if (job->in_sg.size == 0 || job->in_sg.size > MIN(device->weight_cache_size, UINT32_MAX))
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: model %u weights of 0x%" PRIx64
+									   " bytes do not fit in the cache\n",
+					  job->model, job->in_sg.size);
+		job->error = INFERENCE_ERROR_MODEL;
+		goto out;
+	}
+
+	job->input_len = job->in_sg.size;
+	job->output_len = 0;
+	w = inference_weights_reserve(device, job->model, job->input_len);
+	if (!w)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: model %u weights do not fit next to those in use\n",
+					  job->model);
+		job->error = INFERENCE_ERROR_MODEL;
+		goto out;
+	}
+	/* dma_buf_write() moves data towards the device, i.e. out of guest memory */
+	if (dma_buf_write(w->data, job->input_len, NULL, &job->in_sg, INFERENCE_DMA_ATTRS) != MEMTX_OK)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: DMA read of the model %u weights failed\n", job->model);
+		inference_weights_put(device, w);
+		job->error = INFERENCE_ERROR_DMA;
+		goto out;
+	}
+	inference_weights_commit(device, w);
+
+out:
+	qemu_sglist_destroy(&job->in_sg);
+	qemu_sglist_destroy(&job->out_sg);
+}
+
+/* Runs one job on the calling worker, returns false if it was cancelled */
+static bool inference_run_job(struct PciInferenceDevice *device, struct InferenceWorker *worker,
+							  struct InferenceJob *job)
+{
+	bool finished;
+
+	/* Loads only move data, a STOP or a VM stop does not interrupt them */
+	if (job->load)
+	{
+		inference_run_load(device, job);
+		return true;
+	}
+
+	if (job->dma)
+	{
+		inference_dma_prepare(device, job);
+	}
+
+	/* A failed transfer finishes the job with an error, without running it */
+	finished = job->error != INFERENCE_ERROR_NONE || start_inference(device, worker, job);
+
+	if (job->dma)
+	{
+		inference_dma_complete(device, job, finished && job->error == INFERENCE_ERROR_NONE);
+	}
+
+	return finished;
+}
+
+/*
+ * Points a job without DMA at its tensors in BAR1: dma_src and dma_dst
+ * are offsets in the tensor memory, dma_src_len and dma_dst_len lengths.
+ */
+static void inference_window_prepare(struct PciInferenceDevice *device, struct InferenceJob *job)
+{
+	uint8_t *mem = memory_region_get_ram_ptr(&device->tensor_mem);
+
+	if (job->src_len == 0 || job->dst_len == 0 || job->src > device->mem_size ||
+		job->src_len > device->mem_size - job->src || job->dst > device->mem_size ||
+		job->dst_len > device->mem_size - job->dst || ranges_overlap(job->src, job->src_len, job->dst, job->dst_len))
+	{
+		qemu_log_mask(LOG_GUEST_ERROR,
+					  "pci-inference-device: tensors at 0x%" PRIx64 "+0x%x and 0x%" PRIx64
+					  "+0x%x do not fit apart in the tensor memory\n",
+					  job->src, job->src_len, job->dst, job->dst_len);
+		job->error = INFERENCE_ERROR_LENGTH;
+		return;
+	}
+
+	job->input = mem + job->src;
+	job->input_len = job->src_len;
+	job->output = mem + job->dst;
+	job->output_len = job->dst_len;
+}
+
+static void *pci_inference_device_worker(void *opaque)
+{
+	struct PciInferenceDevice *device = opaque;
+	struct InferenceWorker *worker = &device->legacy;
+
+	/* pci_dma_read()/pci_dma_write() walk RCU protected memory maps */
+	rcu_register_thread();
+
+	while (1)
+	{
+		struct InferenceJob job;
+		int64_t start_ns;
+		bool finished;
+
+		qemu_mutex_lock(&worker->mutex);
+		while ((!device->job_pending || worker->paused) && !worker->stopping)
+		{
+			qemu_cond_wait(&worker->cond, &worker->mutex);
+		}
+
+		if (worker->stopping)
+		{
+			qemu_mutex_unlock(&worker->mutex);
+			break;
+		}
+
+		device->job_pending = false;
+		job = device->job;
+		worker->running++;
+		qemu_mutex_unlock(&worker->mutex);
+
+		if (!job.dma)
+		{
+			inference_window_prepare(device, &job);
+		}
+
+		start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+		finished = inference_run_job(device, worker, &job);
+		if (finished)
+		{
+			inference_stats_complete(device, &job, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
+		}
+
+		/*
+		 * Unlike guest RAM written through the DMA API, the tensor memory is
+		 * written behind the back of the dirty log, by this thread or by a
+		 * remote engine. Mark the output dirty once it is written, even for
+		 * a cancelled job that may have written part of it, so that precopy
+		 * migration sends it again while jobs keep running. Only the output
+		 * range of the job is marked, and only if the backend got it.
+		 */
+		if (!job.dma && job.submitted)
+		{
+			memory_region_set_dirty(&device->tensor_mem, job.dst, job.output_len);
+		}
+
+		qemu_mutex_lock(&worker->mutex);
+		worker->running--;
+		qemu_cond_broadcast(&worker->idle_cond);
+		if (!finished)
+		{
+			/* A job interrupted by a VM stop runs again from scratch once the VM resumes */
+			if (worker->paused && worker->seq == job.seq)
+			{
+				device->job_pending = true;
+			}
+			qemu_mutex_unlock(&worker->mutex);
+			continue;
+		}
+		device->job_done_seq = job.seq;
+		device->job_done_error = job.error;
+		device->job_done_deadline = device->model_clock_mhz ? job.submit_vt + inference_model_latency(device, &job) : 0;
+		qemu_mutex_unlock(&worker->mutex);
+
+		/* Registers are only touched under the BQL, so finish the job in the main loop */
+		qemu_bh_schedule(device->done_bh);
+	}
+
+	rcu_unregister_thread();
+	return NULL;
+}
+
+static void inference_submission_decode(const struct InferenceSubmission *entry, struct InferenceJob *job)
+{
+	job->id = le16_to_cpu(entry->id);
+	job->dma = true;
+	job->sg = le16_to_cpu(entry->flags) & INFERENCE_SUBMIT_F_SG;
+	job->load = le16_to_cpu(entry->flags) & INFERENCE_SUBMIT_F_LOAD;
+	job->model = le32_to_cpu(entry->model);
+	job->src = le64_to_cpu(entry->src);
+	job->dst = le64_to_cpu(entry->dst);
+	job->src_len = le32_to_cpu(entry->src_len);
+	job->dst_len = le32_to_cpu(entry->dst_len);
+	job->sg_table = le64_to_cpu(entry->sg_table);
+	job->sg_count = le32_to_cpu(entry->sg_count);
+}
+
+/* Turns a submission queue entry into a job, the entry is fetched with DMA; returns true for a batch */
+static bool inference_queue_fetch(struct InferenceQueue *queue, dma_addr_t addr, struct InferenceJob *job)
+{
+	struct InferenceSubmission entry;
+
+	if (inference_dma_read(queue->device, addr, &entry, sizeof(entry)) != MEMTX_OK)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u entry read from 0x%" PRIx64 " failed\n",
+					  queue->index, addr);
+		job->error = INFERENCE_ERROR_DMA;
+		return false;
+	}
+
+	inference_submission_decode(&entry, job);
+	trace_pci_inference_queue_fetch(queue->index, addr, job->id, le16_to_cpu(entry.flags) & INFERENCE_SUBMIT_F_BATCH);
+	return le16_to_cpu(entry.flags) & INFERENCE_SUBMIT_F_BATCH;
+}
+
+/* Called with queue->worker.mutex held, every job in flight takes one completion entry once retired */
+static bool inference_queue_cq_room(struct InferenceQueue *queue)
+{
+	uint32_t free;
+
+	if (queue->regs.cq_size == 0)
+	{
+		return true;
+	}
+	free = (queue->regs.cq_head + queue->regs.cq_size - queue->cq_tail - 1) % queue->regs.cq_size;
+	return g_queue_get_length(&queue->inflight) < free;
+}
+
+/* Retires the entry at head, called with queue->worker.mutex held */
+static void inference_queue_complete(struct InferenceQueue *queue, struct InferenceJob *job, int64_t exec_ns,
+									 int64_t finish_ns)
+{
+	trace_pci_inference_queue_complete(queue->index, job->id, job->error, exec_ns);
+	inference_stats_complete(queue->device, job, exec_ns);
+	if (queue->regs.cq_size != 0)
+	{
+		struct InferenceCompletion cqe = {
+			.id = cpu_to_le16(job->id),
+			.status = cpu_to_le16(queue->cq_phase | job->error << INFERENCE_CQE_ERROR_SHIFT),
+			.exec_ns = cpu_to_le64(exec_ns),
+		};
+		dma_addr_t addr = queue->regs.cq_base + (dma_addr_t)queue->cq_tail * sizeof(cqe);
+
+		queue->cq_tail = (queue->cq_tail + 1) % queue->regs.cq_size;
+		if (queue->cq_tail == 0)
+		{
+			queue->cq_phase ^= INFERENCE_CQE_PHASE;
+		}
+
+		if (inference_dma_write(queue->device, addr, &cqe, sizeof(cqe)) != MEMTX_OK)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u completion write to 0x%" PRIx64
+										   " failed\n",
+						  queue->index, addr);
+			job->error = INFERENCE_ERROR_DMA;
+		}
+	}
+
+	queue->irq_pending |= INFERENCE_IRQ_DONE;
+	queue->irq_completions++;
+	/* A coalescing setup that never fires must not grow it forever */
+	if (queue->irq_wait->len < INFERENCE_QUEUE_MAX_SIZE)
+	{
+		g_array_append_val(queue->irq_wait, finish_ns);
+	}
+	if (job->error != INFERENCE_ERROR_NONE)
+	{
+		queue->regs.status.bitfields.error = job->error;
+		queue->irq_pending |= INFERENCE_IRQ_ERROR;
+	}
+	queue->regs.head = (queue->regs.head + 1) % queue->regs.size;
+	queue->regs.status.bitfields.busy = queue->regs.head != queue->regs.doorbell;
+
+	/* Interrupts are coalesced and raised from the device AioContext */
+	qemu_bh_schedule(queue->irq_bh);
+}
+
+/* Tells whether the modelled accelerator is done with @pjob, arms the model timer otherwise */
+static bool inference_queue_model_done(struct InferenceQueue *queue, struct InferencePoolJob *pjob)
+{
+	struct PciInferenceDevice *device = queue->device;
+
+	if (device->model_clock_mhz == 0)
+	{
+		return true;
+	}
+
+	/* Computed in ring order, so that each entry starts once the previous one is done */
+	if (pjob->deadline == 0)
+	{
+		pjob->deadline = MAX(pjob->job.submit_vt, queue->model_retired) + inference_model_latency(device, &pjob->job);
+	}
+	if (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) >= pjob->deadline)
+	{
+		return true;
+	}
+	timer_mod(&queue->model_timer, pjob->deadline);
+	return false;
+}
+
+/*
+ * Retires the finished jobs at the front of the in-flight list, in ring
+ * order, called with queue->worker.mutex held.
+ */
+static void inference_queue_retire(struct InferenceQueue *queue)
+{
+	struct InferencePoolJob *pjob;
+
+	while ((pjob = g_queue_peek_head(&queue->inflight)) && pjob->state == INFERENCE_POOL_JOB_DONE && pjob->finished &&
+		   inference_queue_model_done(queue, pjob))
+	{
+		int64_t finish_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+		g_queue_pop_head(&queue->inflight);
+		if (pjob == queue->fence)
+		{
+			queue->fence = NULL;
+		}
+		queue->model_retired = MAX(queue->model_retired, pjob->deadline);
+		if (pjob->start_ns != 0)
+		{
+			finish_ns = pjob->start_ns + pjob->exec_ns;
+			inference_latency_record(&queue->latency[INFERENCE_LATENCY_SUBMIT_TO_START],
+									 pjob->start_ns - pjob->submit_ns);
+			inference_latency_record(&queue->latency[INFERENCE_LATENCY_START_TO_FINISH], pjob->exec_ns);
+		}
+		inference_queue_complete(queue, &pjob->job, pjob->exec_ns, finish_ns);
+		inference_pool_job_free(pjob);
+	}
+}
+
+/*
+ * Runs in the device AioContext once the timing model lets the head entry
+ * complete. The entry was done when the timer was armed, see
+ * inference_queue_model_done(), the timer never waits for the backend.
+ */
+static void inference_queue_model_timeout(void *opaque)
+{
+	struct InferenceQueue *queue = opaque;
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	inference_queue_retire(queue);
+	qemu_mutex_unlock(&queue->worker.mutex);
+}
+
+/* Hands a job to the pool, its home worker is the one of the queue unless its deque is full */
+static void inference_pool_push(struct PciInferenceDevice *device, uint32_t home, struct InferencePoolJob *pjob)
+{
+	for (uint32_t i = 0; i < device->pool_size; i++)
+	{
+		if (ptr_ring_mp_push(&device->pool[(home + i) % device->pool_size].jobs, pjob))
+		{
+			qemu_sem_post(&device->pool_sem);
+			return;
+		}
+	}
+
+	/* The deques are sized for every job the queues may have in flight, and the batch members they queue */
+	g_assert_not_reached();
+}
+
+/* Takes a job from the own deque first, then steals from the other workers */
+static struct InferencePoolJob *inference_pool_take(struct InferencePoolWorker *worker)
+{
+	struct PciInferenceDevice *device = worker->device;
+
+	/* pool_sem was posted for a job, it may just not be published yet */
+	for (;;)
+	{
+		for (uint32_t i = 0; i < device->pool_size; i++)
+		{
+			struct InferencePoolJob *pjob = ptr_ring_mp_pop(&device->pool[(worker->index + i) % device->pool_size].jobs);
+
+			if (pjob)
+			{
+				return pjob;
+			}
+		}
+		cpu_relax();
+	}
+}
+
+/* Called with queue->worker.mutex held once @pjob ran, @finished is false if it was interrupted */
+static void inference_pool_job_finish(struct InferencePoolJob *pjob, bool finished)
+{
+	if (pjob->orphan)
+	{
+		inference_pool_job_free(pjob);
+		return;
+	}
+
+	/* A job interrupted by a VM stop blocks retirement until the ring is fetched again */
+	pjob->state = INFERENCE_POOL_JOB_DONE;
+	pjob->finished = finished;
+	inference_queue_retire(pjob->queue);
+}
+
+/* Folds a member into its batch, which carries the error of the first member that failed */
+static void inference_batch_account(struct InferencePoolJob *pjob, uint32_t index, const struct InferenceJob *job)
+{
+	/* Only the statistics and the timing model read the lengths of a batch */
+	if (job->error == INFERENCE_ERROR_NONE)
+	{
+		pjob->job.input_len += job->input_len;
+		pjob->job.output_len += job->output_len;
+	}
+	else if (index < pjob->error_member)
+	{
+		pjob->error_member = index;
+		pjob->job.error = job->error;
+	}
+}
+
+/* Called with queue->worker.mutex held, the last member to finish completes the batch */
+static void inference_batch_member_finish(struct InferencePoolJob *member, bool finished)
+{
+	struct InferencePoolJob *pjob = member->parent;
+
+	inference_batch_account(pjob, member->member, &member->job);
+	pjob->interrupted |= !finished;
+	g_free(member);
+
+	if (--pjob->pending_members == 0)
+	{
+		pjob->exec_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - pjob->start_ns;
+		inference_pool_job_finish(pjob, !pjob->interrupted);
+	}
+}
+
+/* Runs a member of a batch, on the worker that took it from the pool or on the one that started the batch */
+static void inference_batch_run_member(struct InferencePoolJob *member)
+{
+	struct InferenceQueue *queue = member->queue;
+	struct InferenceWorker *worker = &queue->worker;
+	bool finished = false;
+	bool run;
+
+	/* Like whole jobs, members left behind by a reset or a VM stop do not run */
+	qemu_mutex_lock(&worker->mutex);
+	run = !member->parent->orphan && !worker->paused;
+	if (run)
+	{
+		worker->running++;
+	}
+	qemu_mutex_unlock(&worker->mutex);
+
+	if (run)
+	{
+		finished = start_inference(queue->device, worker, &member->job);
+	}
+	inference_dma_complete(queue->device, &member->job, finished && member->job.error == INFERENCE_ERROR_NONE);
+
+	qemu_mutex_lock(&worker->mutex);
+	inference_batch_member_finish(member, finished);
+	if (run)
+	{
+		worker->running--;
+		qemu_cond_broadcast(&worker->idle_cond);
+	}
+	qemu_mutex_unlock(&worker->mutex);
+}
+
+/*
+ * Starts a batch entry: sg_table holds the IOVA of a contiguous array of
+ * sg_count submissions. Each of them becomes a pool job, so that idle
+ * workers run them concurrently, and the last one to finish completes the
+ * batch as a single queue entry carrying the first error of its jobs. If
+ * one is cancelled, the batch runs again as a whole. Called by a pool
+ * worker that accounts the batch as running, which it stops doing here.
+ */
+static void inference_batch_start(struct PciInferenceDevice *device, struct InferencePoolJob *pjob)
+{
+	struct InferenceQueue *queue = pjob->queue;
+	struct InferenceWorker *worker = &queue->worker;
+	struct InferenceJob *batch = &pjob->job;
+	g_autofree struct InferenceSubmission *entries = NULL;
+	g_autofree struct InferencePoolJob **members = NULL;
+	uint32_t count = batch->sg_count;
+	uint32_t pending = 0;
+	uint32_t local = 1;
+	uint64_t total = 0;
+
+	batch->input_len = 0;
+	batch->output_len = 0;
+	pjob->error_member = UINT32_MAX;
+
+	if (count == 0 || count > INFERENCE_BATCH_MAX_JOBS)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: bad batch size %u\n", count);
+		batch->error = INFERENCE_ERROR_DESC;
+		count = 0;
+	}
+	else
+	{
+		entries = g_new(struct InferenceSubmission, count);
+		if (inference_dma_read(device, batch->sg_table, entries, count * sizeof(*entries)) != MEMTX_OK)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: batch read from 0x%" PRIx64 " failed\n",
+						  batch->sg_table);
+			batch->error = INFERENCE_ERROR_DMA;
+			count = 0;
+		}
+	}
+
+	members = g_new(struct InferencePoolJob *, MAX(count, 1));
+	for (uint32_t i = 0; i < count; i++)
+	{
+		struct InferencePoolJob *member = g_new0(struct InferencePoolJob, 1);
+		struct InferenceJob *job = &member->job;
+
+		member->queue = queue;
+		member->parent = pjob;
+		member->member = i;
+		job->seq = batch->seq;
+		inference_submission_decode(&entries[i], job);
+		if (le16_to_cpu(entries[i].flags) & INFERENCE_SUBMIT_F_BATCH)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: nested batch at index %u\n", i);
+			job->error = INFERENCE_ERROR_DESC;
+		}
+		else if (job->load)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: model load in a batch at index %u\n", i);
+			job->error = INFERENCE_ERROR_DESC;
+		}
+		else
+		{
+			inference_dma_prepare(device, job);
+			if (job->error == INFERENCE_ERROR_NONE)
+			{
+				total += job->input_len + job->output_len;
+			}
+			if (job->error == INFERENCE_ERROR_NONE && total > INFERENCE_BATCH_MAX_LEN)
+			{
+				qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: batch larger than 0x%" PRIx64 " bytes\n",
+							  (uint64_t)INFERENCE_BATCH_MAX_LEN);
+				job->error = INFERENCE_ERROR_LENGTH;
+			}
+		}
+
+		/* A member that already failed does not run, no other thread sees the batch yet */
+		if (job->error != INFERENCE_ERROR_NONE)
+		{
+			inference_dma_complete(device, job, false);
+			inference_batch_account(pjob, i, job);
+			g_free(member);
+			continue;
+		}
+		members[pending++] = member;
+	}
+
+	/* Hand all members but the first to idle workers, while the deques have the room for them */
+	pjob->pending_members = pending;
+	for (uint32_t i = 1; i < pending; i++)
+	{
+		if (qatomic_fetch_inc(&queue->members_queued) >= INFERENCE_BATCH_MAX_JOBS)
+		{
+			qatomic_dec(&queue->members_queued);
+			members[local++] = members[i];
+			continue;
+		}
+		inference_pool_push(device, queue->index, members[i]);
+	}
+
+	qemu_mutex_lock(&worker->mutex);
+	if (pending == 0)
+	{
+		pjob->exec_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - pjob->start_ns;
+		inference_pool_job_finish(pjob, true);
+	}
+	worker->running--;
+	qemu_cond_broadcast(&worker->idle_cond);
+	qemu_mutex_unlock(&worker->mutex);
+
+	/* pjob may be gone by now, the members kept here still hold it */
+	for (uint32_t i = 0; i < MIN(local, pending); i++)
+	{
+		inference_batch_run_member(members[i]);
+	}
+}
+
+static void inference_pool_run(struct InferencePoolJob *pjob)
+{
+	struct InferenceQueue *queue = pjob->queue;
+	struct InferenceWorker *worker = &queue->worker;
+	int64_t start_ns;
+	bool finished;
+
+	if (pjob->parent)
+	{
+		qatomic_dec(&queue->members_queued);
+		inference_batch_run_member(pjob);
+		return;
+	}
+
+	qemu_mutex_lock(&worker->mutex);
+	if (pjob->orphan)
+	{
+		inference_pool_job_free(pjob);
+		qemu_mutex_unlock(&worker->mutex);
+		return;
+	}
+	if (worker->paused)
+	{
+		/* Left in flight, inference_vm_state_change() drops it and the ring is fetched again */
+		pjob->state = INFERENCE_POOL_JOB_DONE;
+		qemu_mutex_unlock(&worker->mutex);
+		return;
+	}
+	pjob->state = INFERENCE_POOL_JOB_RUNNING;
+	worker->running++;
+	qemu_mutex_unlock(&worker->mutex);
+
+	start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+	pjob->start_ns = start_ns;
+	if (pjob->batch)
+	{
+		inference_batch_start(queue->device, pjob);
+		return;
+	}
+	finished = inference_run_job(queue->device, worker, &pjob->job);
+	pjob->exec_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+	qemu_mutex_lock(&worker->mutex);
+	inference_pool_job_finish(pjob, finished);
+
+	/* A VM stop waits for this, the completion entry must not change guest memory after it */
+	worker->running--;
+	qemu_cond_broadcast(&worker->idle_cond);
+	qemu_mutex_unlock(&worker->mutex);
+}
+
+static void *inference_pool_worker(void *opaque)
+{
+	struct InferencePoolWorker *worker = opaque;
+	struct PciInferenceDevice *device = worker->device;
+
+	rcu_register_thread();
+
+	for (;;)
+	{
+		qemu_sem_wait(&device->pool_sem);
+		if (qatomic_read(&device->pool_stopping))
+		{
+			break;
+		}
+		inference_pool_run(inference_pool_take(worker));
+	}
+
+	rcu_unregister_thread();
+	return NULL;
+}
+
+/*
+ * Each queue has a dispatcher thread that fetches its entries and hands
+ * them to the worker pool, so that a busy queue spreads over idle workers
+ * instead of waiting behind its own jobs. Jobs of a queue may thus run
+ * concurrently and finish out of order; they still retire in ring order.
+ * A load is a fence: the entries after it are fetched once it retired.
+ */
+static void *inference_queue_worker(void *opaque)
+{
+	struct InferenceQueue *queue = opaque;
+	struct InferenceWorker *worker = &queue->worker;
+	struct PciInferenceDevice *device = queue->device;
+
+	rcu_register_thread();
+
+	qemu_mutex_lock(&worker->mutex);
+	while (!worker->stopping)
+	{
+		struct InferencePoolJob *pjob;
+		dma_addr_t addr;
+		bool batch;
+
+		if (worker->paused || queue->regs.size == 0 || queue->fetched == queue->regs.doorbell || queue->fence ||
+			queue->outstanding >= INFERENCE_QUEUE_MAX_INFLIGHT || !inference_queue_cq_room(queue))
+		{
+			queue->regs.status.bitfields.busy = queue->regs.head != queue->regs.doorbell;
+			qemu_cond_wait(&worker->cond, &worker->mutex);
+			continue;
+		}
+
+		queue->regs.status.bitfields.busy = 1;
+		addr = queue->regs.base + (dma_addr_t)queue->fetched * sizeof(struct InferenceSubmission);
+
+		pjob = g_new0(struct InferencePoolJob, 1);
+		pjob->submit_ns = queue->submit_ns[queue->fetched];
+		pjob->job.submit_vt = queue->submit_vt[queue->fetched];
+		queue->fetched = (queue->fetched + 1) % queue->regs.size;
+		queue->outstanding++;
+		pjob->queue = queue;
+		pjob->job.seq = worker->seq;
+		g_queue_push_tail(&queue->inflight, pjob);
+		worker->running++;
+		qemu_mutex_unlock(&worker->mutex);
+
+		batch = inference_queue_fetch(queue, addr, &pjob->job);
+
+		qemu_mutex_lock(&worker->mutex);
+		pjob->batch = batch;
+		if (pjob->orphan)
+		{
+			inference_pool_job_free(pjob);
+		}
+		else if (pjob->job.error != INFERENCE_ERROR_NONE)
+		{
+			/* An entry that cannot be read completes with the error */
+			pjob->state = INFERENCE_POOL_JOB_DONE;
+			pjob->finished = true;
+			inference_queue_retire(queue);
+		}
+		else
+		{
+			/* Entries after a load may name its model, they wait until it is resident */
+			if (pjob->job.load)
+			{
+				queue->fence = pjob;
+			}
+			/* The pool worker locks the mutex to start the job, it must not find it held here */
+			qemu_mutex_unlock(&worker->mutex);
+			inference_pool_push(device, queue->index, pjob);
+			qemu_mutex_lock(&worker->mutex);
+		}
+		worker->running--;
+		qemu_cond_broadcast(&worker->idle_cond);
+	}
+	qemu_mutex_unlock(&worker->mutex);
+
+	rcu_unregister_thread();
+	return NULL;
+}
+
+static void pci_inference_device_job_done(void *opaque)
+{
+	struct PciInferenceDevice *device = opaque;
+	int64_t deadline;
+	bool finished;
+	uint8_t error;
+
+	/* Interrupts wait for the VM to run again, see inference_vm_state_change() */
+	if (!runstate_is_running())
+	{
+		return;
+	}
+
+	qemu_mutex_lock(&device->legacy.mutex);
+	finished = device->job_done_seq == device->legacy.seq;
+	error = device->job_done_error;
+	deadline = device->job_done_deadline;
+	qemu_mutex_unlock(&device->legacy.mutex);
+
+	/* The job was stopped or the device was reset meanwhile, or it was already completed */
+	if (!finished || !device->regspace.status.bitfields.busy)
+	{
+		return;
+	}
+
+	/* The backend was faster than the modelled accelerator, complete when the model says, else right now */
+	if (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < deadline)
+	{
+		timer_mod(&device->job_timer, deadline);
+		return;
+	}
+
+	device->regspace.status.bitfields.busy = 0;
+	device->regspace.status.bitfields.done = 1;
+	device->regspace.status.bitfields.error = error;
+	device->regspace.control.bitfields.start = 0;
+	trace_pci_inference_job_done(device->legacy.seq, error);
+
+	/* The START job shares the vector of queue 0 */
+	inference_raise_irq(device, 0, INFERENCE_IRQ_DONE | (error != INFERENCE_ERROR_NONE ? INFERENCE_IRQ_ERROR : 0));
+}
+
+static uint64_t inference_queue_read(struct InferenceQueue *queue, hwaddr offset, uint32_t size)
+{
+	uint64_t value = 0;
+
+	if (size != 4)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue registers are 32-bit wide\n");
+		return 0;
+	}
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	switch (offset)
+	{
+	case offsetof(struct QueueRegisterSpace, head):
+		value = queue->regs.head;
+		break;
+	case offsetof(struct QueueRegisterSpace, base):
+		value = extract64(queue->regs.base, 0, 32);
+		break;
+	case offsetof(struct QueueRegisterSpace, base) + 4:
+		value = extract64(queue->regs.base, 32, 32);
+		break;
+	case offsetof(struct QueueRegisterSpace, size):
+		value = queue->regs.size;
+		break;
+	case offsetof(struct QueueRegisterSpace, status):
+		value = queue->regs.status.value;
+		break;
+	case offsetof(struct QueueRegisterSpace, coalesce_count):
+		value = queue->regs.coalesce_count;
+		break;
+	case offsetof(struct QueueRegisterSpace, coalesce_usec):
+		value = queue->regs.coalesce_usec;
+		break;
+	case offsetof(struct QueueRegisterSpace, shadow_tail):
+		value = extract64(queue->regs.shadow_tail, 0, 32);
+		break;
+	case offsetof(struct QueueRegisterSpace, shadow_tail) + 4:
+		value = extract64(queue->regs.shadow_tail, 32, 32);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_base):
+		value = extract64(queue->regs.cq_base, 0, 32);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_base) + 4:
+		value = extract64(queue->regs.cq_base, 32, 32);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_size):
+		value = queue->regs.cq_size;
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_head):
+		value = queue->regs.cq_head;
+		break;
+	default:
+		/* The doorbell is write-only and the rest of the page is reserved */
+		break;
+	}
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	return value;
 }
 
-static void stop_inference(void)
+static void inference_queue_write(struct InferenceQueue *queue, hwaddr offset, uint64_t value, uint32_t size)
 {
-	/* TODO: The same */
-	printf("Stop inference\n");
-	return;
+	if (size != 4)
+	{
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue registers are 32-bit wide\n");
+		return;
+	}
+
+	qemu_mutex_lock(&queue->worker.mutex);
+	switch (offset)
+	{
+	case offsetof(struct QueueRegisterSpace, doorbell):
+		inference_queue_kick(queue, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, base):
+		queue->regs.base = deposit64(queue->regs.base, 0, 32, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, base) + 4:
+		queue->regs.base = deposit64(queue->regs.base, 32, 32, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, size):
+		if (value > INFERENCE_QUEUE_MAX_SIZE)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u size %" PRIu64 " too big\n",
+						  queue->index, value);
+			break;
+		}
+		/* Reprogramming the ring drops whatever the worker is doing */
+		queue->worker.seq++;
+		queue->regs.size = value;
+		queue->regs.head = 0;
+		queue->regs.doorbell = 0;
+		queue->regs.status.value = 0;
+		inference_queue_drop_inflight(queue);
+		qemu_cond_signal(&queue->worker.cond);
+		break;
+	case offsetof(struct QueueRegisterSpace, coalesce_count):
+		queue->regs.coalesce_count = value;
+		break;
+	case offsetof(struct QueueRegisterSpace, coalesce_usec):
+		queue->regs.coalesce_usec = value;
+		break;
+	case offsetof(struct QueueRegisterSpace, shadow_tail):
+		queue->regs.shadow_tail = deposit64(queue->regs.shadow_tail, 0, 32, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, shadow_tail) + 4:
+		queue->regs.shadow_tail = deposit64(queue->regs.shadow_tail, 32, 32, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_base):
+		queue->regs.cq_base = deposit64(queue->regs.cq_base, 0, 32, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_base) + 4:
+		queue->regs.cq_base = deposit64(queue->regs.cq_base, 32, 32, value);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_size):
+		if (value > INFERENCE_QUEUE_MAX_SIZE || value == 1)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u completion ring size %" PRIu64
+										   " invalid\n",
+						  queue->index, value);
+			break;
+		}
+		queue->regs.cq_size = value;
+		queue->regs.cq_head = 0;
+		queue->cq_tail = 0;
+		queue->cq_phase = INFERENCE_CQE_PHASE;
+		qemu_cond_signal(&queue->worker.cond);
+		break;
+	case offsetof(struct QueueRegisterSpace, cq_head):
+		if (value >= queue->regs.cq_size)
+		{
+			qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: queue %u completion head %" PRIu64
+										   " out of ring\n",
+						  queue->index, value);
+			break;
+		}
+		queue->regs.cq_head = value;
+		qemu_cond_signal(&queue->worker.cond);
+		break;
+	default:
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: write to RO or reserved queue register 0x%" HWADDR_PRIx "\n",
+					  offset);
+		break;
+	}
+	qemu_mutex_unlock(&queue->worker.mutex);
+
+	if (offset == offsetof(struct QueueRegisterSpace, shadow_tail) ||
+		offset == offsetof(struct QueueRegisterSpace, shadow_tail) + 4)
+	{
+		inference_queue_update_ioeventfd(queue);
+	}
 }
 
 static uint64_t
 pci_inference_device_bar0_mmio_read(void *ptr, hwaddr offset, uint32_t size)
 {
-	printf("pci_inference_device_bar0_mmio_read() offset = 0x%lx; size = 0x%x \n", offset, size);
-
 	/* `ptr` was given in memory_region_init_io() function */
 	struct PciInferenceDevice *device = ptr;
 	uint8_t *base = (uint8_t *)(&device->regspace);
+	uint64_t value = 0;
 
-	return *((uint64_t *)(base + offset));
+	if (offset >= INFERENCE_QUEUE_STRIDE)
+	{
+		uint32_t index = offset / INFERENCE_QUEUE_STRIDE - 1;
+
+		if (index < device->num_queues)
+		{
+			value = inference_queue_read(&device->queues[index], offset % INFERENCE_QUEUE_STRIDE, size);
+		}
+	}
+	else if (offset >= INFERENCE_STATS_OFFSET)
+	{
+		hwaddr reg = offset - INFERENCE_STATS_OFFSET;
+
+		/* Accesses straddling two counters and the rest of the page read as zero */
+		if (reg / 8 < INFERENCE_STAT_COUNT && reg % 8 + size <= 8)
+		{
+			value = extract64(stat64_get(&device->stats[reg / 8]), reg % 8 * 8, size * 8);
+		}
+	}
+	/* The rest of the global page is reserved */
+	else if (offset + size <= sizeof(device->regspace))
+	{
+		memcpy(&value, base + offset, size);
+	}
+
+	trace_pci_inference_bar0_read(offset, size, value);
+	return value;
 }
 
 static void pci_inference_device_bar0_mmio_write(void *ptr, hwaddr offset, uint64_t value,
 												 uint32_t size)
 {
-	printf("pci_inference_device_bar0_mmio_write() addr = 0x%lx; size = 0x%x; value = 0x%lx\n", offset, size, value);
 	struct PciInferenceDevice *device = ptr;
 
+	trace_pci_inference_bar0_write(offset, size, value);
+
+	if (offset >= INFERENCE_QUEUE_STRIDE)
+	{
+		uint32_t index = offset / INFERENCE_QUEUE_STRIDE - 1;
+
+		if (index < device->num_queues)
+		{
+			inference_queue_write(&device->queues[index], offset % INFERENCE_QUEUE_STRIDE, value, size);
+		}
+		return;
+	}
+
+	if (offset + size > sizeof(device->regspace))
+	{
+		return;
+	}
+
 	/* We shouldn't allow to write in RO register */
-	if ((offsetof(struct RegisterSpace, status) <= offset) && (offset < offsetof(struct RegisterSpace, status) + sizeof(device->regspace.status)))
+	if (((offsetof(struct RegisterSpace, status) <= offset) && (offset < offsetof(struct RegisterSpace, status) + sizeof(device->regspace.status))) ||
+		((offsetof(struct RegisterSpace, num_queues) <= offset) && (offset < offsetof(struct RegisterSpace, num_queues) + sizeof(device->regspace.num_queues))))
 	{
-		printf("pci_inference_device_bar0_mmio_write() couldn't write to RO register\n");
+		qemu_log_mask(LOG_GUEST_ERROR, "pci-inference-device: write to RO register 0x%" HWADDR_PRIx "\n", offset);
 		return;
 	}
 
 	uint8_t *base = (uint8_t *)(&device->regspace);
 
-	*((uint64_t *)(base + offset)) = value;
+	/* Store only `size` bytes, a wider store would clobber the neighbouring registers */
+	memcpy(base + offset, &value, size);
 
 	if (device->regspace.control.bitfields.reset == 1)
 	{
+		cancel_inference(device);
+		for (uint32_t i = 0; i < device->num_queues; i++)
+		{
+			inference_queue_reset(&device->queues[i]);
+		}
+		inference_weights_flush(device);
+
+		/* The tensor memory keeps its contents, clearing it would fault in the whole BAR */
 		memset((uint8_t *)(&device->regspace), 0, sizeof(device->regspace));
-		memset(&device->input_data, 0, sizeof(device->input_data));
-		memset(&device->output_data, 0, sizeof(device->output_data));
+		device->regspace.num_queues = device->num_queues;
 
-		printf("Reset done\n");
+		trace_pci_inference_reset();
 	}
 
-	if (device->regspace.control.bitfields.start == 1)
+	if (device->regspace.control.bitfields.start == 1 && device->regspace.status.bitfields.busy == 0)
 	{
 		device->regspace.status.bitfields.busy = 1;
 		device->regspace.status.bitfields.done = 0;
+		device->regspace.status.bitfields.error = INFERENCE_ERROR_NONE;
 		device->regspace.control.bitfields.stop = 0;
 
-		start_inference();
-
-		memset(&device->input_data, 0xBEEF, sizeof(device->input_data));
-		memset(&device->output_data, 0xDEADBEEF, sizeof(device->output_data));
-
-		device->regspace.status.bitfields.busy = 0;
-		device->regspace.status.bitfields.done = 1;
-		device->regspace.control.bitfields.start = 0;
-		printf("Finish inference\n");
+		/* Hand the job over to the worker, the vCPU returns right away */
+		qemu_mutex_lock(&device->legacy.mutex);
+		device->legacy.seq++;
+		device->job = (struct InferenceJob){
+			.seq = device->legacy.seq,
+			.submit_vt = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL),
+			.dma = device->regspace.control.bitfields.dma || device->regspace.control.bitfields.sg,
+			.sg = device->regspace.control.bitfields.sg,
+			.src = device->regspace.dma_src,
+			.dst = device->regspace.dma_dst,
+			.src_len = device->regspace.dma_src_len,
+			.dst_len = device->regspace.dma_dst_len,
+			.sg_table = device->regspace.sg_table,
+			.sg_count = device->regspace.sg_count,
+		};
+		device->job_pending = true;
+		inference_stats_submit(device, 1, 0);
+		trace_pci_inference_job_start(device->job.seq, device->job.dma, device->job.sg);
+		qemu_cond_signal(&device->legacy.cond);
+		qemu_mutex_unlock(&device->legacy.mutex);
 	}
 	else if (device->regspace.control.bitfields.stop == 1)
 	{
@@ -137,37 +2297,14 @@ static void pci_inference_device_bar0_mmio_write(void *ptr, hwaddr offset, uint6
 		device->regspace.status.bitfields.done = 0;
 		device->regspace.control.bitfields.start = 0;
 
-		stop_inference();
+		/* The worker cancels the backend request once it notices the new seq */
+		trace_pci_inference_job_stop(device->legacy.seq);
+		cancel_inference(device);
 
 		device->regspace.control.bitfields.stop = 0;
 	}
 }
 
-static uint64_t
-pci_inference_device_bar1_mmio_read(void *ptr, hwaddr offset, uint32_t size)
-{
-	printf("pci_inference_device_bar1_mmio_read() offset = 0x%lx; size = 0x%x \n", offset, size);
-
-	struct PciInferenceDevice *device = ptr;
-	return *((uint64_t *)(&device->input_data + offset));
-}
-
-static void pci_inference_device_bar1_mmio_write(void *ptr, hwaddr offset, uint64_t value,
-												 uint32_t size)
-{
-	struct PciInferenceDevice *device = ptr;
-	*((uint64_t *)(&device->input_data + offset)) = value;
-}
-
-static uint64_t
-pci_inference_device_bar2_mmio_read(void *ptr, hwaddr offset, uint32_t size)
-{
-	printf("pci_inference_device_bar2_mmio_read() offset = 0x%lx; size = 0x%x \n", offset, size);
-
-	struct PciInferenceDevice *device = ptr;
-	return *((uint64_t *)(&device->output_data + offset));
-}
-
 /* Operations for the Memory Region */
 static const MemoryRegionOps bar0_mmio_ops = {
 	.read = pci_inference_device_bar0_mmio_read,
@@ -184,34 +2321,176 @@ static const MemoryRegionOps bar0_mmio_ops = {
 
 };
 
-static const MemoryRegionOps bar1_mmio_ops = {
-	.read = pci_inference_device_bar1_mmio_read,
-	.write = pci_inference_device_bar1_mmio_write,
-	.endianness = DEVICE_LITTLE_ENDIAN,
-	.valid = {
-		.min_access_size = 1,
-		.max_access_size = 8,
-	},
-	.impl = {
-		.min_access_size = 1,
-		.max_access_size = 8,
-	},
+static void inference_thread_create(struct PciInferenceDevice *device, QemuThread *thread, const char *name,
+									void *(*fn)(void *), void *opaque)
+{
+	if (device->thread_context)
+	{
+		thread_context_create_thread(device->thread_context, thread, name, fn, opaque, QEMU_THREAD_JOINABLE);
+	}
+	else
+	{
+		qemu_thread_create(thread, name, fn, opaque, QEMU_THREAD_JOINABLE);
+	}
+}
 
-};
+static void inference_worker_start(struct PciInferenceDevice *device, struct InferenceWorker *worker,
+								   const char *name, void *(*fn)(void *), void *opaque)
+{
+	qemu_mutex_init(&worker->mutex);
+	qemu_cond_init(&worker->cond);
+	qemu_cond_init(&worker->idle_cond);
+	/* Devices are realized before the VM starts, or while an incoming migration is pending */
+	worker->paused = !runstate_is_running();
+	inference_thread_create(device, &worker->thread, name, fn, opaque);
+}
 
-static const MemoryRegionOps bar2_mmio_ops = {
-	.read = pci_inference_device_bar2_mmio_read,
-	/* .write = NULL since we want RO memory region */
-	.endianness = DEVICE_LITTLE_ENDIAN,
-	.valid = {
-		.min_access_size = 1,
-		.max_access_size = 8,
-	},
-	.impl = {
-		.min_access_size = 1,
-		.max_access_size = 8,
-	},
-};
+static void inference_worker_stop(struct InferenceWorker *worker)
+{
+	qemu_mutex_lock(&worker->mutex);
+	worker->stopping = true;
+	qemu_cond_broadcast(&worker->cond);
+	qemu_mutex_unlock(&worker->mutex);
+	qemu_thread_join(&worker->thread);
+
+	qemu_cond_destroy(&worker->idle_cond);
+	qemu_cond_destroy(&worker->cond);
+	qemu_mutex_destroy(&worker->mutex);
+}
+
+/* Interrupts the running job, the worker leaves it at its next cancellation point */
+static void inference_worker_pause(struct InferenceWorker *worker)
+{
+	qemu_mutex_lock(&worker->mutex);
+	worker->paused = true;
+	qemu_mutex_unlock(&worker->mutex);
+}
+
+/* Waits until the worker leaves its job, returns right away if idle */
+static void inference_worker_wait_idle(struct InferenceWorker *worker)
+{
+	qemu_mutex_lock(&worker->mutex);
+	while (worker->running)
+	{
+		qemu_cond_wait(&worker->idle_cond, &worker->mutex);
+	}
+	qemu_mutex_unlock(&worker->mutex);
+}
+
+static void inference_worker_resume(struct InferenceWorker *worker)
+{
+	qemu_mutex_lock(&worker->mutex);
+	worker->paused = false;
+	qemu_cond_broadcast(&worker->cond);
+	qemu_mutex_unlock(&worker->mutex);
+}
+
+/*
+ * Jobs keep running in the worker threads regardless of the vCPUs, so
+ * they are quiesced when the VM stops: guest memory and device state
+ * must not change while they are saved. Rather than waiting for the
+ * running jobs to finish, they are cancelled and run again from scratch
+ * when the VM resumes, here or on the migration destination.
+ *
+ * The wait keeps the BQL: workers never take it, see INFERENCE_DMA_ATTRS.
+ */
+static void inference_device_quiesce(struct PciInferenceDevice *device)
+{
+	inference_worker_pause(&device->legacy);
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		inference_worker_pause(&device->queues[i].worker);
+	}
+
+	inference_worker_wait_idle(&device->legacy);
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		inference_worker_wait_idle(&device->queues[i].worker);
+	}
+}
+
+static void inference_vm_state_change(void *opaque, bool running, RunState state)
+{
+	struct PciInferenceDevice *device = opaque;
+
+	if (!running)
+	{
+		inference_device_quiesce(device);
+		return;
+	}
+
+	inference_worker_resume(&device->legacy);
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		struct InferenceQueue *queue = &device->queues[i];
+
+		/* Entries not retired before the stop are fetched and run again */
+		qemu_mutex_lock(&queue->worker.mutex);
+		inference_queue_drop_inflight(queue);
+		qemu_mutex_unlock(&queue->worker.mutex);
+
+		inference_worker_resume(&queue->worker);
+		/* Deliver the completions held back while the VM was stopped */
+		qemu_bh_schedule(device->queues[i].irq_bh);
+	}
+	qemu_bh_schedule(device->done_bh);
+}
+
+/* The tensor memory lives in a memfd when possible, so that remote backends can map it */
+static bool inference_tensor_mem_init(struct PciInferenceDevice *device, Error **errp)
+{
+	const char *name = "pci-inference-device-tensor-mem";
+
+#ifdef CONFIG_LINUX
+	if (qemu_memfd_check(MFD_ALLOW_SEALING))
+	{
+		int fd = qemu_memfd_create(name, device->mem_size, false, 0, F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+								   errp);
+
+		if (fd < 0)
+		{
+			return false;
+		}
+		/* The RAM block owns the fd from now on */
+		if (!memory_region_init_ram_from_fd(&device->tensor_mem, OBJECT(device), name, device->mem_size, RAM_SHARED,
+											fd, 0, errp))
+		{
+			close(fd);
+			return false;
+		}
+		vmstate_register_ram(&device->tensor_mem, DEVICE(device));
+		return true;
+	}
+#endif
+
+	return memory_region_init_ram(&device->tensor_mem, OBJECT(device), name, device->mem_size, errp);
+}
+
+/* Binds the tensor memory to the host node before the guest or a job touches it */
+static bool inference_tensor_mem_bind(struct PciInferenceDevice *device, Error **errp)
+{
+	if (device->host_node == NUMA_NODE_UNASSIGNED)
+	{
+		return true;
+	}
+
+#ifdef CONFIG_NUMA
+	unsigned long nodes[BITS_TO_LONGS(MAX_NODES + 1)] = {0};
+
+	set_bit(device->host_node, nodes);
+	/* Like memory backends, pass one more node than needed, see host_memory_backend_memory_complete() */
+	if (mbind(memory_region_get_ram_ptr(&device->tensor_mem), device->mem_size, MPOL_BIND, nodes,
+			  device->host_node + 2, MPOL_MF_STRICT | MPOL_MF_MOVE))
+	{
+		error_setg_errno(errp, errno, "cannot bind the tensor memory to host node %u", device->host_node);
+		return false;
+	}
+	return true;
+#else
+	error_setg(errp, "node requires host NUMA support, which this QEMU was built without");
+	return false;
+#endif
+}
 
 /* Implementation of the realize function */
 static void pci_inference_device_realize(PCIDevice *pdev, Error **errp)
@@ -219,27 +2498,401 @@ static void pci_inference_device_realize(PCIDevice *pdev, Error **errp)
 	struct PciInferenceDevice *device = INFERENCEDEV(pdev);
 	uint8_t *pci_config = pdev->config;
 
+	if (device->pool_size > INFERENCE_POOL_MAX_WORKERS)
+	{
+		error_setg(errp, "workers must not exceed %d", INFERENCE_POOL_MAX_WORKERS);
+		return;
+	}
+
+	if (device->num_queues == 0 || device->num_queues > INFERENCE_MAX_QUEUES)
+	{
+		error_setg(errp, "num-queues must be between 1 and %d", INFERENCE_MAX_QUEUES);
+		return;
+	}
+
+	if (device->mem_size < INFERENCE_MEM_MIN_SIZE || !is_power_of_2(device->mem_size))
+	{
+		error_setg(errp, "mem-size must be a power of two of at least %d KiB", INFERENCE_MEM_MIN_SIZE / KiB);
+		return;
+	}
+	if (device->host_node != NUMA_NODE_UNASSIGNED && device->host_node >= MAX_NODES)
+	{
+		error_setg(errp, "node must be below %d", MAX_NODES);
+		return;
+	}
+	if (device->model_clock_mhz != 0 && device->model_ops_per_cycle == 0)
+	{
+		error_setg(errp, "model-ops-per-cycle must not be zero");
+		return;
+	}
+	if (device->weight_cache_size == 0)
+	{
+		error_setg(errp, "weight-cache-size must not be zero");
+		return;
+	}
+	if (!inference_tensor_mem_init(device, errp) || !inference_tensor_mem_bind(device, errp) ||
+		!memory_region_init_ram(&device->weights_mem, OBJECT(device), "pci-inference-device-weights",
+								device->weight_cache_size, errp))
+	{
+		return;
+	}
+
 	pci_config_set_interrupt_pin(pci_config, 1);
 
+	if (device->ioeventfd && !device->iothread)
+	{
+		static uint32_t iothread_count;
+		g_autofree char *name = g_strdup_printf("inference-iothread-%u", qatomic_fetch_inc(&iothread_count));
+
+		device->internal_iothread = iothread_create(name, errp);
+		if (!device->internal_iothread)
+		{
+			return;
+		}
+	}
+
+	if (msix_init_exclusive_bar(pdev, device->num_queues + 1, INFERENCE_MSIX_BAR, errp))
+	{
+		if (device->internal_iothread)
+		{
+			iothread_destroy(device->internal_iothread);
+			device->internal_iothread = NULL;
+		}
+		return;
+	}
+	for (uint32_t i = 0; i <= device->num_queues; i++)
+	{
+		msix_vector_use(pdev, i);
+	}
+
+	if (!device->backend)
+	{
+		device->default_backend = object_new(TYPE_INFERENCE_BACKEND_NULL);
+	}
+
 	/* Initial configuration of devices registers */
 	memset((uint8_t *)(&device->regspace), 0, sizeof(device->regspace));
-	memset(&device->input_data, 0, sizeof(device->input_data));
-	memset(&device->output_data, 0, sizeof(device->output_data));
+	device->regspace.num_queues = device->num_queues;
 
 	/* Initialize an I/O memory */
 	/* Accesses to this region will cause the callbacks */
 	/* of the `bar0_mmio_ops` to be called */
-	memory_region_init_io(&device->mmio_bar0, OBJECT(device), &bar0_mmio_ops, device, "pci-inference-device-mmio_bar0", sizeof(device->regspace));
-	memory_region_init_io(&device->mmio_bar1, OBJECT(device), &bar1_mmio_ops, device, "pci-inference-device-mmio_bar1", sizeof(device->input_data));
-	memory_region_init_io(&device->mmio_bar2, OBJECT(device), &bar2_mmio_ops, device, "pci-inference-device-mmio_bar2", sizeof(device->output_data));
+	/* The global registers page is followed by one doorbell page per queue */
+	memory_region_init_io(&device->mmio_bar0, OBJECT(device), &bar0_mmio_ops, device, "pci-inference-device-mmio_bar0",
+						  pow2ceil((device->num_queues + 1) * INFERENCE_QUEUE_STRIDE));
 
 	/* Registering the pdev and all of the above configuration */
 	/* (actually filling a PCI-IO region with our configuration */
 	pci_register_bar(pdev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &device->mmio_bar0);
-	pci_register_bar(pdev, 1, PCI_BASE_ADDRESS_SPACE_MEMORY, &device->mmio_bar1);
-	pci_register_bar(pdev, 2, PCI_BASE_ADDRESS_SPACE_MEMORY, &device->mmio_bar2);
+	/* The tensor memory is plain RAM, guest accesses to it never exit */
+	/* Being 64-bit, BAR1 also takes the slot of BAR2 */
+	pci_register_bar(pdev, 1,
+					 PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_PREFETCH | PCI_BASE_ADDRESS_MEM_TYPE_64,
+					 &device->tensor_mem);
+
+	device->done_bh = qemu_bh_new_guarded(pci_inference_device_job_done, device,
+										  &DEVICE(device)->mem_reentrancy_guard);
+	timer_init_ns(&device->job_timer, QEMU_CLOCK_VIRTUAL, pci_inference_device_job_done, device);
+	qemu_mutex_init(&device->weights_lock);
+	device->weights = g_hash_table_new(NULL, NULL);
+	QTAILQ_INIT(&device->weights_lru);
+	QTAILQ_INIT(&device->weights_extents);
+	inference_worker_start(device, &device->legacy, "inference", pci_inference_device_worker, device);
+
+	if (device->pool_size == 0)
+	{
+		device->pool_size = device->num_queues;
+	}
+	qemu_sem_init(&device->pool_sem, 0);
+	device->pool = g_new0(struct InferencePoolWorker, device->pool_size);
+	for (uint32_t i = 0; i < device->pool_size; i++)
+	{
+		struct InferencePoolWorker *worker = &device->pool[i];
+		g_autofree char *name = g_strdup_printf("inference-w%u", i);
+
+		worker->device = device;
+		worker->index = i;
+		/* Even if every queue pushes all its jobs and batch members to the same worker */
+		ptr_ring_mp_init(&worker->jobs, device->num_queues * (INFERENCE_QUEUE_MAX_INFLIGHT + INFERENCE_BATCH_MAX_JOBS));
+		inference_thread_create(device, &worker->thread, name, inference_pool_worker, worker);
+	}
+
+	device->queues = g_new0(struct InferenceQueue, device->num_queues);
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		struct InferenceQueue *queue = &device->queues[i];
+		g_autofree char *name = g_strdup_printf("inference-q%u", i);
+
+		queue->device = device;
+		queue->index = i;
+		queue->cq_phase = INFERENCE_CQE_PHASE;
+		queue->submit_ns = g_new0(int64_t, INFERENCE_QUEUE_MAX_SIZE);
+		queue->submit_vt = g_new0(int64_t, INFERENCE_QUEUE_MAX_SIZE);
+		queue->irq_wait = g_array_new(FALSE, FALSE, sizeof(int64_t));
+		for (int j = 0; j < INFERENCE_LATENCY_COUNT; j++)
+		{
+			qdist_init(&queue->latency[j]);
+		}
+		queue->irq_bh = aio_bh_new_guarded(inference_aio_context(device), inference_queue_irq, queue,
+										   &DEVICE(device)->mem_reentrancy_guard);
+		aio_timer_init(inference_aio_context(device), &queue->coalesce_timer, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+					   inference_queue_coalesce_timeout, queue);
+		aio_timer_init(inference_aio_context(device), &queue->model_timer, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+					   inference_queue_model_timeout, queue);
+		inference_worker_start(device, &queue->worker, name, inference_queue_worker, queue);
+	}
+
+	device->vmstate_change = qdev_add_vm_change_state_handler(DEVICE(device), inference_vm_state_change, device);
+}
+
+static void pci_inference_device_uninit(PCIDevice *pdev)
+{
+	struct PciInferenceDevice *device = INFERENCEDEV(pdev);
+
+	qemu_del_vm_change_state_handler(device->vmstate_change);
+
+	/* Cancel the jobs in flight, the pool workers free them */
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		struct InferenceQueue *queue = &device->queues[i];
+
+		qemu_mutex_lock(&queue->worker.mutex);
+		queue->worker.stopping = true;
+		inference_queue_drop_inflight(queue);
+		qemu_mutex_unlock(&queue->worker.mutex);
+	}
+
+	qatomic_set(&device->pool_stopping, true);
+	for (uint32_t i = 0; i < device->pool_size; i++)
+	{
+		qemu_sem_post(&device->pool_sem);
+	}
+	for (uint32_t i = 0; i < device->pool_size; i++)
+	{
+		qemu_thread_join(&device->pool[i].thread);
+	}
+	/* Only orphans and their members are left in the deques, running them releases them */
+	for (uint32_t i = 0; i < device->pool_size; i++)
+	{
+		struct InferencePoolJob *pjob;
+
+		while ((pjob = ptr_ring_mp_pop(&device->pool[i].jobs)))
+		{
+			inference_pool_run(pjob);
+		}
+		ptr_ring_mp_destroy(&device->pool[i].jobs);
+	}
+	g_free(device->pool);
+	qemu_sem_destroy(&device->pool_sem);
+
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		device->queues[i].regs.shadow_tail = 0;
+		inference_queue_update_ioeventfd(&device->queues[i]);
+		inference_worker_stop(&device->queues[i].worker);
+		qemu_bh_delete(device->queues[i].irq_bh);
+		timer_del(&device->queues[i].coalesce_timer);
+		timer_del(&device->queues[i].model_timer);
+		g_free(device->queues[i].submit_ns);
+		g_free(device->queues[i].submit_vt);
+		g_array_free(device->queues[i].irq_wait, TRUE);
+		for (int j = 0; j < INFERENCE_LATENCY_COUNT; j++)
+		{
+			qdist_destroy(&device->queues[i].latency[j]);
+		}
+	}
+	g_free(device->queues);
+
+	inference_worker_stop(&device->legacy);
+	qemu_bh_delete(device->done_bh);
+	timer_del(&device->job_timer);
+
+	/* All workers are gone, nothing holds weights anymore */
+	inference_weights_flush(device);
+	g_hash_table_destroy(device->weights);
+	qemu_mutex_destroy(&device->weights_lock);
+
+	if (device->internal_iothread)
+	{
+		iothread_destroy(device->internal_iothread);
+	}
+
+	if (device->default_backend)
+	{
+		object_unref(device->default_backend);
+		device->default_backend = NULL;
+	}
+
+	msix_uninit_exclusive_bar(pdev);
+}
+
+/*
+ * The workers are paused by inference_vm_state_change() before the device
+ * state is saved: an interrupted job is still pending (legacy START) or not
+ * retired yet (queues), so it simply runs again on the destination.
+ * The tensor memory and weights_mem migrate as RAM, during precopy; the
+ * device state only carries where each resident model lies in weights_mem.
+ */
+static int pci_inference_device_post_load(void *opaque, int version_id)
+{
+	struct PciInferenceDevice *device = opaque;
+	struct InferenceWeights *w;
+
+	int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+	int64_t now_vt = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+	/* The entries were allocated by the QTAILQ loader, only the migrated fields are set */
+	QTAILQ_FOREACH(w, &device->weights_lru, lru)
+	{
+		if (w->len == 0 || w->offset > device->weight_cache_size - w->len)
+		{
+			return -EINVAL;
+		}
+		w->users = 0;
+		w->evicted = false;
+		g_hash_table_insert(device->weights, GUINT_TO_POINTER(w->model), w);
+		inference_weights_place(device, w);
+	}
+
+	device->regspace.num_queues = device->num_queues;
+	for (uint32_t i = 0; i < device->num_queues; i++)
+	{
+		/* Doorbell times are not migrated, pending entries count as submitted on the destination */
+		for (uint32_t j = 0; j < INFERENCE_QUEUE_MAX_SIZE; j++)
+		{
+			device->queues[i].submit_ns[j] = now;
+			device->queues[i].submit_vt[j] = now_vt;
+		}
+		device->queues[i].fetched = device->queues[i].regs.head;
+		inference_queue_update_ioeventfd(&device->queues[i]);
+	}
+	return 0;
+}
+
+/* Models loaded before a loadvm are not those of the snapshot */
+static int pci_inference_device_pre_load(void *opaque)
+{
+	struct PciInferenceDevice *device = opaque;
+
+	inference_weights_flush(device);
+	return 0;
 }
 
+static const VMStateDescription vmstate_inference_job = {
+	.name = "pci-inference-device/job",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]){
+		VMSTATE_UINT32(seq, struct InferenceJob),
+		VMSTATE_BOOL(dma, struct InferenceJob),
+		VMSTATE_BOOL(sg, struct InferenceJob),
+		VMSTATE_UINT64(src, struct InferenceJob),
+		VMSTATE_UINT64(dst, struct InferenceJob),
+		VMSTATE_UINT32(src_len, struct InferenceJob),
+		VMSTATE_UINT32(dst_len, struct InferenceJob),
+		VMSTATE_UINT64(sg_table, struct InferenceJob),
+		VMSTATE_UINT32(sg_count, struct InferenceJob),
+		VMSTATE_INT64(submit_vt, struct InferenceJob),
+		VMSTATE_END_OF_LIST(),
+	},
+};
+
+static const VMStateDescription vmstate_inference_weights = {
+	.name = "pci-inference-device/weights",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]){
+		VMSTATE_UINT32(model, struct InferenceWeights),
+		VMSTATE_UINT32(len, struct InferenceWeights),
+		VMSTATE_UINT64(offset, struct InferenceWeights),
+		VMSTATE_END_OF_LIST(),
+	},
+};
+
+static const VMStateDescription vmstate_inference_queue = {
+	.name = "pci-inference-device/queue",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]){
+		VMSTATE_UINT32(regs.doorbell, struct InferenceQueue),
+		VMSTATE_UINT32(regs.head, struct InferenceQueue),
+		VMSTATE_UINT64(regs.base, struct InferenceQueue),
+		VMSTATE_UINT32(regs.size, struct InferenceQueue),
+		VMSTATE_UINT32(regs.status.value, struct InferenceQueue),
+		VMSTATE_UINT32(regs.coalesce_count, struct InferenceQueue),
+		VMSTATE_UINT32(regs.coalesce_usec, struct InferenceQueue),
+		VMSTATE_UINT64(regs.shadow_tail, struct InferenceQueue),
+		VMSTATE_UINT64(regs.cq_base, struct InferenceQueue),
+		VMSTATE_UINT32(regs.cq_size, struct InferenceQueue),
+		VMSTATE_UINT32(regs.cq_head, struct InferenceQueue),
+		VMSTATE_UINT32(cq_tail, struct InferenceQueue),
+		VMSTATE_UINT16(cq_phase, struct InferenceQueue),
+		VMSTATE_UINT32(irq_pending, struct InferenceQueue),
+		VMSTATE_UINT32(irq_completions, struct InferenceQueue),
+		VMSTATE_UINT32(coalesced, struct InferenceQueue),
+		VMSTATE_TIMER(coalesce_timer, struct InferenceQueue),
+		VMSTATE_INT64(model_retired, struct InferenceQueue),
+		VMSTATE_END_OF_LIST(),
+	},
+};
+
+static const VMStateDescription vmstate_pci_inference_device = {
+	.name = "pci-inference-device",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.pre_load = pci_inference_device_pre_load,
+	.post_load = pci_inference_device_post_load,
+	.fields = (const VMStateField[]){
+		VMSTATE_PCI_DEVICE(pdev, struct PciInferenceDevice),
+		VMSTATE_MSIX(pdev, struct PciInferenceDevice),
+		VMSTATE_UINT32(regspace.control.value, struct PciInferenceDevice),
+		VMSTATE_UINT32(regspace.status.value, struct PciInferenceDevice),
+		VMSTATE_UINT64(regspace.dma_src, struct PciInferenceDevice),
+		VMSTATE_UINT64(regspace.dma_dst, struct PciInferenceDevice),
+		VMSTATE_UINT32(regspace.dma_src_len, struct PciInferenceDevice),
+		VMSTATE_UINT32(regspace.dma_dst_len, struct PciInferenceDevice),
+		VMSTATE_UINT64(regspace.sg_table, struct PciInferenceDevice),
+		VMSTATE_UINT32(regspace.sg_count, struct PciInferenceDevice),
+		VMSTATE_UINT32_EQUAL(num_queues, struct PciInferenceDevice, NULL),
+		VMSTATE_UINT64_EQUAL(mem_size, struct PciInferenceDevice, NULL),
+		VMSTATE_UINT32(legacy.seq, struct PciInferenceDevice),
+		VMSTATE_STRUCT(job, struct PciInferenceDevice, 1, vmstate_inference_job, struct InferenceJob),
+		VMSTATE_UINT32(job_done_seq, struct PciInferenceDevice),
+		VMSTATE_UINT8(job_done_error, struct PciInferenceDevice),
+		VMSTATE_INT64(job_done_deadline, struct PciInferenceDevice),
+		VMSTATE_BOOL(job_pending, struct PciInferenceDevice),
+		VMSTATE_STRUCT_VARRAY_POINTER_UINT32(queues, struct PciInferenceDevice, num_queues,
+											 vmstate_inference_queue, struct InferenceQueue),
+		VMSTATE_UINT64_EQUAL(weight_cache_size, struct PciInferenceDevice, NULL),
+		VMSTATE_QTAILQ_V(weights_lru, struct PciInferenceDevice, 1, vmstate_inference_weights, struct InferenceWeights,
+						 lru),
+		VMSTATE_END_OF_LIST(),
+	},
+};
+
+static Property pci_inference_device_properties[] = {
+	DEFINE_PROP_UINT32("num-queues", struct PciInferenceDevice, num_queues, 1),
+	DEFINE_PROP_UINT32("workers", struct PciInferenceDevice, pool_size, 0),
+	DEFINE_PROP_BOOL("ioeventfd", struct PciInferenceDevice, ioeventfd, true),
+	DEFINE_PROP_LINK("iothread", struct PciInferenceDevice, iothread, TYPE_IOTHREAD, IOThread *),
+	DEFINE_PROP_LINK("backend", struct PciInferenceDevice, backend, TYPE_INFERENCE_BACKEND, InferenceBackend *),
+	DEFINE_PROP_SIZE("mem-size", struct PciInferenceDevice, mem_size, INFERENCE_MEM_DEFAULT_SIZE),
+	DEFINE_PROP_UINT32("node", struct PciInferenceDevice, host_node, NUMA_NODE_UNASSIGNED),
+	DEFINE_PROP_LINK("thread-context", struct PciInferenceDevice, thread_context, TYPE_THREAD_CONTEXT,
+					 ThreadContext *),
+	DEFINE_PROP_UINT32("model-clock-mhz", struct PciInferenceDevice, model_clock_mhz, INFERENCE_MODEL_CLOCK_MHZ),
+	DEFINE_PROP_UINT32("model-ops-per-cycle", struct PciInferenceDevice, model_ops_per_cycle,
+					   INFERENCE_MODEL_OPS_PER_CYCLE),
+	DEFINE_PROP_UINT32("model-ops-per-byte", struct PciInferenceDevice, model_ops_per_byte,
+					   INFERENCE_MODEL_OPS_PER_BYTE),
+	DEFINE_PROP_UINT32("model-bandwidth-mbps", struct PciInferenceDevice, model_bandwidth_mbps,
+					   INFERENCE_MODEL_BANDWIDTH_MBPS),
+	DEFINE_PROP_UINT64("model-overhead-ns", struct PciInferenceDevice, model_overhead_ns, INFERENCE_MODEL_OVERHEAD_NS),
+	DEFINE_PROP_SIZE("weight-cache-size", struct PciInferenceDevice, weight_cache_size,
+					 INFERENCE_WEIGHT_CACHE_DEFAULT_SIZE),
+	DEFINE_PROP_END_OF_LIST(),
+};
+
 static void pci_inference_device_class_init(ObjectClass *class, void *data)
 {
 	DeviceClass *dc = DEVICE_CLASS(class);
@@ -247,12 +2900,15 @@ static void pci_inference_device_class_init(ObjectClass *class, void *data)
 
 	/* Definition of realize func() */
 	k->realize = pci_inference_device_realize;
-	// Definition of uninit func().
+	/* Definition of uninit func() */
+	k->exit = pci_inference_device_uninit;
 	k->vendor_id = PCI_VENDOR_ID_QEMU;
 	k->device_id = PCI_INFERENCE_DEVICE_VENDOR_ID; /* Our device id, '0xCAFE' */
 	k->revision = 0x0;
 	k->class_id = PCI_BASE_CLASS_PROCESSOR; /* For example */
 	dc->desc = "PCI Inference Device";
+	dc->vmsd = &vmstate_pci_inference_device;
+	device_class_set_props(dc, pci_inference_device_properties);
 
 	/**
 	 * set_bit - Set a bit in memory
@@ -262,6 +2918,69 @@ static void pci_inference_device_class_init(ObjectClass *class, void *data)
 	set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
+static InferenceLatency *inference_latency_info(const struct qdist *dist)
+{
+	InferenceLatency *info = g_new0(InferenceLatency, 1);
+
+	info->samples = qdist_sample_count(dist);
+	if (info->samples != 0)
+	{
+		info->p50 = qdist_percentile(dist, 50);
+		info->p99 = qdist_percentile(dist, 99);
+		info->p999 = qdist_percentile(dist, 99.9);
+	}
+	return info;
+}
+
+InferenceDeviceStats *qmp_query_inference_device_stats(const char *id, Error **errp)
+{
+	struct PciInferenceDevice *device;
+	InferenceDeviceStats *info;
+	bool ambiguous = false;
+	Object *obj;
+
+	obj = object_resolve_path_type(id, TYPE_PCI_CUSTOM_DEVICE, &ambiguous);
+	if (!obj)
+	{
+		if (ambiguous)
+		{
+			error_setg(errp, "Device '%s' is ambiguous", id);
+		}
+		else
+		{
+			error_setg(errp, "Device '%s' is not a %s", id, TYPE_PCI_CUSTOM_DEVICE);
+		}
+		return NULL;
+	}
+	device = INFERENCEDEV(obj);
+
+	info = g_new0(InferenceDeviceStats, 1);
+	info->submitted = stat64_get(&device->stats[INFERENCE_STAT_SUBMITTED]);
+	info->completed = stat64_get(&device->stats[INFERENCE_STAT_COMPLETED]);
+	info->errors = stat64_get(&device->stats[INFERENCE_STAT_ERRORS]);
+	info->bytes_in = stat64_get(&device->stats[INFERENCE_STAT_BYTES_IN]);
+	info->bytes_out = stat64_get(&device->stats[INFERENCE_STAT_BYTES_OUT]);
+	info->busy_ns = stat64_get(&device->stats[INFERENCE_STAT_BUSY_NS]);
+	for (int i = INFERENCE_STATS_DEPTH_BUCKETS - 1; i >= 0; i--)
+	{
+		QAPI_LIST_PREPEND(info->queue_depth, stat64_get(&device->stats[INFERENCE_STAT_QUEUE_DEPTH + i]));
+	}
+	for (int i = device->num_queues - 1; i >= 0; i--)
+	{
+		struct InferenceQueue *queue = &device->queues[i];
+		InferenceQueueLatency *latency = g_new0(InferenceQueueLatency, 1);
+
+		latency->queue = i;
+		qemu_mutex_lock(&queue->worker.mutex);
+		latency->submit_to_start = inference_latency_info(&queue->latency[INFERENCE_LATENCY_SUBMIT_TO_START]);
+		latency->start_to_finish = inference_latency_info(&queue->latency[INFERENCE_LATENCY_START_TO_FINISH]);
+		latency->finish_to_irq = inference_latency_info(&queue->latency[INFERENCE_LATENCY_FINISH_TO_IRQ]);
+		qemu_mutex_unlock(&queue->worker.mutex);
+		QAPI_LIST_PREPEND(info->queues, latency);
+	}
+	return info;
+}
+
 static InterfaceInfo interfaces[] = {
 	{INTERFACE_CONVENTIONAL_PCI_DEVICE},
 	{},
@@ -58,6 +58,7 @@
 #include "hw/pci/pci.h"
 #include "qemu/timer.h"
 #include "exec/memory.h"
+#include "exec/ramblock.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
 #include "hw/remote/vfio-user-obj.h"
@@ -509,6 +510,9 @@ static vfu_region_access_cb_t *vfu_object_bar_handlers[PCI_NUM_REGIONS] = {
 /**
  * vfu_object_register_bars - Identify active BAR regions of pdev and setup
  *                            callbacks to handle read/write accesses
+ *
+ * BARs backed by shareable RAM are also offered to the client for mmap,
+ * so that its accesses to them do not go through the socket.
  */
 static void vfu_object_register_bars(vfu_ctx_t *vfu_ctx, PCIDevice *pdev)
 {
@@ -516,19 +520,35 @@ static void vfu_object_register_bars(vfu_ctx_t *vfu_ctx, PCIDevice *pdev)
     int i;
 
     for (i = 0; i < PCI_NUM_REGIONS; i++) {
+        MemoryRegion *mr = pdev->io_regions[i].memory;
+        struct iovec mmap_area = {
+            .iov_base = 0,
+            .iov_len = pdev->io_regions[i].size,
+        };
+        int fd = -1;
+        uint64_t fd_offset = 0;
+
         if (!pdev->io_regions[i].size) {
             continue;
         }
 
-        if ((i == VFU_PCI_DEV_ROM_REGION_IDX) ||
-            pdev->io_regions[i].memory->readonly) {
+        if ((i == VFU_PCI_DEV_ROM_REGION_IDX) || mr->readonly) {
             flags &= ~VFU_REGION_FLAG_WRITE;
         }
 
+        /* libvfio-user closes the region fds with the context */
+        if (memory_region_is_ram(mr) && mr->ram_block &&
+            memory_region_get_fd(mr) >= 0) {
+            fd = dup(memory_region_get_fd(mr));
+            fd_offset = mr->ram_block->fd_offset;
+        }
+
         vfu_setup_region(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX + i,
                          (size_t)pdev->io_regions[i].size,
                          vfu_object_bar_handlers[i],
-                         flags, NULL, 0, -1, 0);
+                         fd < 0 ? flags : flags | VFU_REGION_FLAG_MEM,
+                         fd < 0 ? NULL : &mmap_area, fd < 0 ? 0 : 1,
+                         fd, fd_offset);
 
         trace_vfu_bar_register(i, pdev->io_regions[i].addr,
                                pdev->io_regions[i].size);
@@ -0,0 +1,148 @@
+/*
+ * Lock-free bounded ring of pointers
+ *
+ * PtrRingMP accepts any number of producers and consumers, e.g. for a
+ * worker's job queue that other workers steal from. Producers claim slots
+ * with a compare-and-swap on the tail and consumers with one on the head;
+ * every slot carries a sequence number telling whether it is free for the
+ * lap that a producer claimed or holds a pointer published for consumers.
+ *
+ * It takes no locks, so it can hand work between a thread holding the
+ * BQL and worker threads without either side ever blocking the other.
+ * Waking a consumer that sleeps on an empty ring is left to the user,
+ * e.g. with a QemuEvent. NULL cannot be pushed, it means "empty".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_PTR_RING_H
+#define QEMU_PTR_RING_H
+
+#include "qemu/atomic.h"
+
+/* Keeps the producer and the consumer indexes on different cache lines */
+#define PTR_RING_ALIGN 64
+
+typedef struct PtrRingMPSlot {
+    unsigned long seq;
+    void *ptr;
+} PtrRingMPSlot;
+
+typedef struct PtrRingMP {
+    PtrRingMPSlot *slots;
+    unsigned long mask;
+
+    unsigned long tail QEMU_ALIGNED(PTR_RING_ALIGN);
+    unsigned long head QEMU_ALIGNED(PTR_RING_ALIGN);
+} PtrRingMP;
+
+/**
+ * ptr_ring_mp_init - Initialize a multi-producer multi-consumer ring
+ * @ring: the ring
+ * @size: number of entries, rounded up to a power of two
+ */
+void ptr_ring_mp_init(PtrRingMP *ring, unsigned long size);
+
+/**
+ * ptr_ring_mp_destroy - Free the slots of a ring
+ * @ring: the ring, whose remaining entries are dropped
+ */
+void ptr_ring_mp_destroy(PtrRingMP *ring);
+
+/**
+ * ptr_ring_mp_push - Append an entry, from any thread
+ * @ring: the ring
+ * @ptr: the entry, not NULL
+ *
+ * Returns: false if the ring is full.
+ */
+static inline bool ptr_ring_mp_push(PtrRingMP *ring, void *ptr)
+{
+    unsigned long tail = qatomic_read(&ring->tail);
+    PtrRingMPSlot *slot;
+
+    for (;;) {
+        long diff;
+
+        slot = &ring->slots[tail & ring->mask];
+        diff = (long)(qatomic_load_acquire(&slot->seq) - tail);
+        if (diff == 0) {
+            /* The slot is free for this lap, try to claim it */
+            unsigned long old = qatomic_cmpxchg(&ring->tail, tail, tail + 1);
+
+            if (old == tail) {
+                break;
+            }
+            tail = old;
+        } else if (diff < 0) {
+            /* No consumer has freed the slot of the previous lap yet */
+            return false;
+        } else {
+            /* Another producer claimed it meanwhile */
+            tail = qatomic_read(&ring->tail);
+        }
+    }
+
+    slot->ptr = ptr;
+    qatomic_store_release(&slot->seq, tail + 1);
+    return true;
+}
+
+/**
+ * ptr_ring_mp_pop - Take the oldest entry, from any thread
+ * @ring: the ring
+ *
+ * A producer that claimed the oldest slot but has not filled it yet
+ * makes the ring look empty until it does.
+ *
+ * Returns: the entry, or NULL if the ring is empty.
+ */
+static inline void *ptr_ring_mp_pop(PtrRingMP *ring)
+{
+    unsigned long head = qatomic_read(&ring->head);
+    PtrRingMPSlot *slot;
+    void *ptr;
+
+    for (;;) {
+        long diff;
+
+        slot = &ring->slots[head & ring->mask];
+        diff = (long)(qatomic_load_acquire(&slot->seq) - (head + 1));
+        if (diff == 0) {
+            /* The slot holds an entry, try to claim it */
+            unsigned long old = qatomic_cmpxchg(&ring->head, head, head + 1);
+
+            if (old == head) {
+                break;
+            }
+            head = old;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            /* Another consumer took it meanwhile */
+            head = qatomic_read(&ring->head);
+        }
+    }
+
+    ptr = slot->ptr;
+    /* Frees the slot for the producers of the next lap */
+    qatomic_store_release(&slot->seq, head + ring->mask + 1);
+    return ptr;
+}
+
+/**
+ * ptr_ring_mp_empty - Tell whether the ring holds no published entry
+ * @ring: the ring
+ *
+ * Any thread may call it, the answer can be stale by the time it returns.
+ */
+static inline bool ptr_ring_mp_empty(PtrRingMP *ring)
+{
+    unsigned long head = qatomic_read(&ring->head);
+
+    return qatomic_load_acquire(&ring->slots[head & ring->mask].seq) !=
+           head + 1;
+}
+
+#endif
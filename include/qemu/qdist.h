@@ -46,6 +46,7 @@ void qdist_inc(struct qdist *dist, double x);
 double qdist_xmin(const struct qdist *dist);
 double qdist_xmax(const struct qdist *dist);
 double qdist_avg(const struct qdist *dist);
+double qdist_percentile(const struct qdist *dist, double percent);
 unsigned long qdist_sample_count(const struct qdist *dist);
 size_t qdist_unique_entries(const struct qdist *dist);
 
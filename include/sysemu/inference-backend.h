@@ -0,0 +1,85 @@
+/*
+ * QEMU inference backend interface
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INFERENCE_BACKEND_H
+#define QEMU_INFERENCE_BACKEND_H
+
+#include "qom/object.h"
+
+#define TYPE_INFERENCE_BACKEND "inference-backend"
+
+typedef struct InferenceBackendClass InferenceBackendClass;
+DECLARE_CLASS_CHECKERS(InferenceBackendClass, INFERENCE_BACKEND,
+                       TYPE_INFERENCE_BACKEND)
+#define INFERENCE_BACKEND(obj) \
+     INTERFACE_CHECK(InferenceBackend, (obj), \
+                     TYPE_INFERENCE_BACKEND)
+
+typedef struct InferenceBackend InferenceBackend;
+
+#define TYPE_INFERENCE_BACKEND_NULL "inference-backend-null"
+#define TYPE_INFERENCE_BACKEND_CPU "inference-backend-cpu"
+
+/**
+ * InferenceRequest:
+ * @input: the input tensor, valid until the request completes
+ * @input_len: size of @input in bytes
+ * @output: buffer receiving the result, valid until the request completes
+ * @output_len: size of @output in bytes
+ * @weights: weights of the model the request runs against, or NULL;
+ * read-only and valid until the request completes
+ * @weights_len: size of @weights in bytes
+ * @submit_ns: QEMU_CLOCK_REALTIME timestamp set by inference_backend_submit()
+ * @opaque: owned by the backend between submit and completion
+ *
+ * The device owns the request and both buffers; the backend may only
+ * touch them between inference_backend_submit() and the moment
+ * inference_backend_poll() reports completion or
+ * inference_backend_cancel() returns.
+ */
+typedef struct InferenceRequest {
+    const uint8_t *input;
+    size_t input_len;
+    uint8_t *output;
+    size_t output_len;
+    const uint8_t *weights;
+    size_t weights_len;
+    int64_t submit_ns;
+    void *opaque;
+} InferenceRequest;
+
+/**
+ * InferenceBackendClass:
+ * @submit: start @req; returns 0 or a negative errno
+ * @poll: wait at most @timeout_ns for @req to finish; returns 0 once
+ * the output is ready, -EINPROGRESS if it is still running, or another
+ * negative errno if it failed
+ * @cancel: abort a submitted request that has not completed yet
+ *
+ * Devices call these from their worker threads without the BQL, possibly
+ * from several threads at once for different requests.
+ */
+struct InferenceBackendClass {
+    /* <private> */
+    InterfaceClass parent_class;
+
+    /* <public> */
+    int (*submit)(InferenceBackend *backend, InferenceRequest *req,
+                  Error **errp);
+    int (*poll)(InferenceBackend *backend, InferenceRequest *req,
+                int64_t timeout_ns);
+    void (*cancel)(InferenceBackend *backend, InferenceRequest *req);
+};
+
+int inference_backend_submit(InferenceBackend *backend, InferenceRequest *req,
+                             Error **errp);
+int inference_backend_poll(InferenceBackend *backend, InferenceRequest *req,
+                           int64_t timeout_ns);
+void inference_backend_cancel(InferenceBackend *backend,
+                              InferenceRequest *req);
+
+#endif
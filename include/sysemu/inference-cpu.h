@@ -0,0 +1,31 @@
+/*
+ * Compute kernels of the CPU inference backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INFERENCE_CPU_H
+#define QEMU_INFERENCE_CPU_H
+
+typedef struct InferenceCpuKernels {
+    const char *name;
+    /* c[m][n] = a[m][k] * b[k][n] */
+    void (*gemm)(size_t m, size_t k, size_t n,
+                 const float *a, const float *b, float *c);
+    void (*relu)(size_t n, const float *x, float *y);
+    void (*gelu)(size_t n, const float *x, float *y);
+    /* Softmax of one row */
+    void (*softmax)(size_t n, const float *x, float *y);
+} InferenceCpuKernels;
+
+/**
+ * inference_cpu_kernels:
+ * @index: rank of the kernel set
+ *
+ * Returns: the kernel sets the host can run, from the fastest at @index 0
+ * to the portable C set, then NULL.
+ */
+const InferenceCpuKernels *inference_cpu_kernels(unsigned index);
+
+#endif
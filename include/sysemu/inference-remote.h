@@ -0,0 +1,62 @@
+/*
+ * Protocol between the remote inference backend and an engine process
+ *
+ * QEMU connects to the engine over a UNIX socket. Tensors are never
+ * copied over the socket: QEMU passes the file descriptors of the
+ * shared memory holding them (the device tensor BAR, guest RAM created
+ * with share=on, or a staging memfd of the backend) once with
+ * INFERENCE_REMOTE_CMD_ADD_REGION, then refers to them by region id.
+ *
+ * Every INFERENCE_REMOTE_CMD_RUN is answered by one InferenceRemoteReply
+ * carrying the tag of the RUN; the other commands have no reply. Several
+ * RUNs may be in flight and their replies may come in any order.
+ * INFERENCE_REMOTE_CMD_CANCEL asks the engine to give up a RUN early, it
+ * is still answered. QEMU closes the connection if a cancelled RUN is not
+ * answered in time; the engine must then stop touching the regions.
+ *
+ * Messages use the host byte order, both ends run on the same host.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INFERENCE_REMOTE_H
+#define QEMU_INFERENCE_REMOTE_H
+
+#define TYPE_INFERENCE_BACKEND_REMOTE "inference-backend-remote"
+
+typedef enum InferenceRemoteCmd {
+    /* Map @size bytes at @fd_offset of the attached fd as @region */
+    INFERENCE_REMOTE_CMD_ADD_REGION = 1,
+    /* Unmap @region, its id may be reused afterwards */
+    INFERENCE_REMOTE_CMD_DEL_REGION = 2,
+    /* Read @input, write @output, then reply with @tag */
+    INFERENCE_REMOTE_CMD_RUN = 3,
+    /* Abandon the RUN with @tag, replying -ECANCELED if not done yet */
+    INFERENCE_REMOTE_CMD_CANCEL = 4,
+} InferenceRemoteCmd;
+
+typedef struct InferenceRemoteBuf {
+    uint32_t region;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t len;
+} InferenceRemoteBuf;
+
+typedef struct InferenceRemoteMsg {
+    uint32_t cmd;
+    uint32_t region;
+    uint64_t size;
+    uint64_t fd_offset;
+    InferenceRemoteBuf input;
+    InferenceRemoteBuf output;
+    uint64_t tag;
+} InferenceRemoteMsg;
+
+typedef struct InferenceRemoteReply {
+    int32_t ret;                /* 0 or a negative errno */
+    uint32_t reserved;
+    uint64_t tag;               /* of the RUN being answered */
+} InferenceRemoteReply;
+
+#endif
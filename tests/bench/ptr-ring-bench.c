@@ -0,0 +1,297 @@
+/*
+ * Throughput of the lock-free pointer ring
+ *
+ * Producers push tagged sequence numbers, consumers pop them and check
+ * that the entries of every producer come out in order. With a single
+ * consumer no entry may be missing either. The -l mode runs the same
+ * traffic through a mutex-protected GQueue for comparison.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/host-utils.h"
+#include "qemu/processor.h"
+#include "qemu/ptr-ring.h"
+
+/* Entries carry the producer index in their low bits, 0 is never pushed */
+#define PRODUCER_BITS 8
+#define MAX_PRODUCERS ((1 << PRODUCER_BITS) - 1)
+
+enum ring_mode {
+    MODE_MPMC,
+    MODE_MUTEX,
+};
+
+struct thread_info {
+    unsigned int id;
+    uint64_t full;              /* pushes that found the ring full */
+} QEMU_ALIGNED(64);
+
+struct consumer_info {
+    uint64_t popped;
+    uint64_t empty;             /* pops that found the ring empty */
+} QEMU_ALIGNED(64);
+
+static QemuThread *threads;
+static struct thread_info *th_info;
+static QemuThread *consumers;
+static struct consumer_info *co_info;
+static unsigned int n_producers = 1;
+static unsigned int n_consumers = 1;
+static unsigned int n_ready_threads;
+static unsigned int duration = 1;
+static unsigned long ring_size = 1024;
+static enum ring_mode mode = MODE_MPMC;
+static bool test_start;
+static bool test_stop;
+
+static PtrRingMP ring;
+static QemuMutex lock;
+static GQueue locked_queue = G_QUEUE_INIT;
+
+static const char commands_string[] =
+    " -n = number of producer threads\n"
+    " -c = number of consumer threads\n"
+    " -l = use a mutex-protected queue instead of a ring\n"
+    " -s = ring size (will be rounded up to pow2)\n"
+    " -d = duration in seconds";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static bool push(void *ptr)
+{
+    bool ret;
+
+    switch (mode) {
+    case MODE_MPMC:
+        return ptr_ring_mp_push(&ring, ptr);
+    default:
+        qemu_mutex_lock(&lock);
+        ret = g_queue_get_length(&locked_queue) < ring_size;
+        if (ret) {
+            g_queue_push_tail(&locked_queue, ptr);
+        }
+        qemu_mutex_unlock(&lock);
+        return ret;
+    }
+}
+
+static void *pop(void)
+{
+    void *ptr;
+
+    switch (mode) {
+    case MODE_MPMC:
+        return ptr_ring_mp_pop(&ring);
+    default:
+        qemu_mutex_lock(&lock);
+        ptr = g_queue_pop_head(&locked_queue);
+        qemu_mutex_unlock(&lock);
+        return ptr;
+    }
+}
+
+static void wait_for_start(void)
+{
+    qatomic_inc(&n_ready_threads);
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+}
+
+static void *producer_func(void *arg)
+{
+    struct thread_info *info = arg;
+    uintptr_t seq = 0;
+
+    wait_for_start();
+
+    while (!qatomic_read(&test_stop)) {
+        void *ptr = (void *)((seq << PRODUCER_BITS) | info->id);
+
+        if (push(ptr)) {
+            seq++;
+        } else {
+            info->full++;
+            cpu_relax();
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_func(void *arg)
+{
+    struct consumer_info *info = arg;
+    g_autofree uintptr_t *next = g_new0(uintptr_t, n_producers + 1);
+    uintptr_t seq_mask = UINTPTR_MAX >> PRODUCER_BITS;
+
+    wait_for_start();
+
+    while (!qatomic_read(&test_stop)) {
+        uintptr_t val = (uintptr_t)pop();
+        uintptr_t seq;
+        unsigned int id;
+
+        if (!val) {
+            info->empty++;
+            cpu_relax();
+            continue;
+        }
+
+        /*
+         * Other consumers take their share of every producer's entries,
+         * so only a lone consumer can tell that one went missing.
+         */
+        id = val & MAX_PRODUCERS;
+        seq = val >> PRODUCER_BITS;
+        if (id == 0 || id > n_producers ||
+            seq < (next[id] & seq_mask) ||
+            (n_consumers == 1 && seq != (next[id] & seq_mask))) {
+            fprintf(stderr, "producer %u: got entry %" PRIuPTR
+                    ", expected %s%" PRIuPTR "\n", id, seq,
+                    n_consumers == 1 ? "" : "at least ",
+                    next[id] & seq_mask);
+            abort();
+        }
+        next[id] = seq + 1;
+        info->popped++;
+    }
+    return NULL;
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    while (qatomic_read(&n_ready_threads) != n_producers + n_consumers) {
+        cpu_relax();
+    }
+
+    qatomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_producers; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    for (i = 0; i < n_consumers; i++) {
+        qemu_thread_join(&consumers[i]);
+    }
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    switch (mode) {
+    case MODE_MPMC:
+        ptr_ring_mp_init(&ring, ring_size);
+        break;
+    default:
+        qemu_mutex_init(&lock);
+        break;
+    }
+
+    threads = g_new(QemuThread, n_producers);
+    th_info = g_new0(struct thread_info, n_producers);
+    consumers = g_new(QemuThread, n_consumers);
+    co_info = g_new0(struct consumer_info, n_consumers);
+
+    for (i = 0; i < n_consumers; i++) {
+        qemu_thread_create(&consumers[i], NULL, consumer_func, &co_info[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < n_producers; i++) {
+        struct thread_info *info = &th_info[i];
+
+        info->id = i + 1;
+        qemu_thread_create(&threads[i], NULL, producer_func, info,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void pr_params(void)
+{
+    static const char *const mode_names[] = {
+        [MODE_MPMC] = "multi-producer multi-consumer ring",
+        [MODE_MUTEX] = "mutex-protected queue",
+    };
+
+    printf("Parameters:\n");
+    printf(" mode:              %s\n", mode_names[mode]);
+    printf(" # of producers:    %u\n", n_producers);
+    printf(" # of consumers:    %u\n", n_consumers);
+    printf(" ring size:         %lu\n", ring_size);
+    printf(" duration:          %u\n", duration);
+}
+
+static void pr_stats(void)
+{
+    uint64_t full = 0, popped = 0, empty = 0;
+    unsigned int i;
+    double tx;
+
+    for (i = 0; i < n_producers; i++) {
+        full += th_info[i].full;
+    }
+    for (i = 0; i < n_consumers; i++) {
+        popped += co_info[i].popped;
+        empty += co_info[i].empty;
+    }
+    tx = popped / duration / 1e6;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Throughput:         %.2f Mops/s\n", tx);
+    printf(" Pushes on full:     %" PRIu64 "\n", full);
+    printf(" Pops on empty:      %" PRIu64 "\n", empty);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "c:hd:n:ls:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'c':
+            n_consumers = MAX(atoi(optarg), 1);
+            break;
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_producers = MIN(MAX(atoi(optarg), 1), MAX_PRODUCERS);
+            break;
+        case 'l':
+            mode = MODE_MUTEX;
+            break;
+        case 's':
+            ring_size = pow2ceil(MAX(atoi(optarg), 1));
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pr_params();
+    create_threads();
+    run_test();
+    pr_stats();
+    return 0;
+}
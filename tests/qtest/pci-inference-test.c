@@ -0,0 +1,418 @@
+/*
+ * QTest testcase for the PCI inference device
+ *
+ * Drives submission queue 0 with the default null backend, which copies
+ * the input of a job to its output, and checks what the guest sees: the
+ * completion entries and their phase bit, the queue registers, the error
+ * codes, batches, model loads and the device reset.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "hw/pci/pci_regs.h"
+
+#define INFERENCE_VENDOR_ID 0x1234
+#define INFERENCE_DEVICE_ID 0xcafe
+
+/* BAR0 layout, see hw/misc/pci_inference_device.c */
+#define REG_CONTROL 0x0
+#define REG_NUM_QUEUES 0x34
+#define CONTROL_RESET 0x4
+
+#define QUEUE_REGS(n) (((n) + 1) * 0x1000)
+#define Q_DOORBELL 0x0
+#define Q_HEAD 0x4
+#define Q_BASE 0x8
+#define Q_SIZE 0x10
+#define Q_STATUS 0x14
+#define Q_CQ_BASE 0x28
+#define Q_CQ_SIZE 0x30
+#define Q_CQ_HEAD 0x34
+
+#define STATUS_ERROR(status) (((status) >> 2) & 0xf)
+
+#define SUBMIT_F_BATCH 0x2
+#define SUBMIT_F_LOAD 0x4
+
+#define CQE_PHASE 0x1
+#define CQE_ERROR(status) ((status) >> 1)
+
+#define ERROR_NONE 0x0
+#define ERROR_DMA 0x1
+#define ERROR_LENGTH 0x2
+#define ERROR_MODEL 0x5
+
+/* Small enough for the completion ring to wrap within a test */
+#define RING_SIZE 8
+#define BUF_SIZE 256
+
+#define TIMEOUT_US (30 * 1000 * 1000)
+
+typedef struct InferenceSubmission {
+    uint16_t id;
+    uint16_t flags;
+    uint32_t model;
+    uint64_t src;
+    uint64_t dst;
+    uint32_t src_len;
+    uint32_t dst_len;
+    uint64_t sg_table;
+    uint32_t sg_count;
+    uint32_t reserved[5];
+} InferenceSubmission;
+
+typedef struct InferenceCompletion {
+    uint16_t id;
+    uint16_t status;
+    uint32_t reserved;
+    uint64_t exec_ns;
+} InferenceCompletion;
+
+typedef struct InferenceState {
+    QOSState *qs;
+    QPCIDevice *dev;
+    QPCIBar bar;
+    uint64_t ring;
+    uint64_t cq;
+    uint32_t tail;
+    uint32_t cq_head;
+    uint16_t phase;
+} InferenceState;
+
+static uint32_t queue_readl(InferenceState *s, uint64_t reg)
+{
+    return qpci_io_readl(s->dev, s->bar, QUEUE_REGS(0) + reg);
+}
+
+static void queue_writel(InferenceState *s, uint64_t reg, uint32_t value)
+{
+    qpci_io_writel(s->dev, s->bar, QUEUE_REGS(0) + reg, value);
+}
+
+/* Programs an empty submission ring and completion ring for queue 0 */
+static void queue_setup(InferenceState *s)
+{
+    qtest_memset(s->qs->qts, s->cq, 0,
+                 RING_SIZE * sizeof(InferenceCompletion));
+    s->tail = 0;
+    s->cq_head = 0;
+    s->phase = CQE_PHASE;
+
+    queue_writel(s, Q_BASE, s->ring);
+    queue_writel(s, Q_BASE + 4, s->ring >> 32);
+    queue_writel(s, Q_SIZE, RING_SIZE);
+    queue_writel(s, Q_CQ_BASE, s->cq);
+    queue_writel(s, Q_CQ_BASE + 4, s->cq >> 32);
+    queue_writel(s, Q_CQ_SIZE, RING_SIZE);
+}
+
+static void setup(InferenceState *s)
+{
+    s->qs = qtest_pc_boot("-device pci-inference-device,addr=04.0");
+    s->dev = qpci_device_find(s->qs->pcibus, QPCI_DEVFN(0x4, 0x0));
+    g_assert(s->dev != NULL);
+    g_assert_cmphex(qpci_config_readw(s->dev, PCI_VENDOR_ID), ==,
+                    INFERENCE_VENDOR_ID);
+    g_assert_cmphex(qpci_config_readw(s->dev, PCI_DEVICE_ID), ==,
+                    INFERENCE_DEVICE_ID);
+    qpci_device_enable(s->dev);
+    s->bar = qpci_iomap(s->dev, 0, NULL);
+    g_assert_cmpuint(qpci_io_readl(s->dev, s->bar, REG_NUM_QUEUES), >=, 1);
+
+    s->ring = guest_alloc(&s->qs->alloc,
+                          RING_SIZE * sizeof(InferenceSubmission));
+    s->cq = guest_alloc(&s->qs->alloc,
+                        RING_SIZE * sizeof(InferenceCompletion));
+    queue_setup(s);
+}
+
+static void cleanup(InferenceState *s)
+{
+    qpci_iounmap(s->dev, s->bar);
+    g_free(s->dev);
+    qtest_shutdown(s->qs);
+}
+
+/* Returns a guest buffer of @len bytes, filled with a pattern based on @seed */
+static uint64_t buf_new(InferenceState *s, size_t len, uint8_t seed)
+{
+    uint64_t addr = guest_alloc(&s->qs->alloc, len);
+    g_autofree uint8_t *data = g_malloc(len);
+
+    for (size_t i = 0; i < len; i++) {
+        data[i] = seed + i;
+    }
+    qtest_memwrite(s->qs->qts, addr, data, len);
+    return addr;
+}
+
+static void buf_assert_equal(InferenceState *s, uint64_t a, uint64_t b,
+                             size_t len)
+{
+    g_autofree uint8_t *data_a = g_malloc(len);
+    g_autofree uint8_t *data_b = g_malloc(len);
+
+    qtest_memread(s->qs->qts, a, data_a, len);
+    qtest_memread(s->qs->qts, b, data_b, len);
+    g_assert(memcmp(data_a, data_b, len) == 0);
+}
+
+static InferenceSubmission job_entry(uint16_t id, uint64_t src, uint64_t dst,
+                                     uint32_t len)
+{
+    return (InferenceSubmission) {
+        .id = cpu_to_le16(id),
+        .src = cpu_to_le64(src),
+        .dst = cpu_to_le64(dst),
+        .src_len = cpu_to_le32(len),
+        .dst_len = cpu_to_le32(len),
+    };
+}
+
+/* Fills the next ring entry, the doorbell is rung by the caller */
+static void push(InferenceState *s, const InferenceSubmission *entry)
+{
+    qtest_memwrite(s->qs->qts, s->ring + s->tail * sizeof(*entry),
+                   entry, sizeof(*entry));
+    s->tail = (s->tail + 1) % RING_SIZE;
+}
+
+static void submit(InferenceState *s, const InferenceSubmission *entry)
+{
+    push(s, entry);
+    queue_writel(s, Q_DOORBELL, s->tail);
+}
+
+/*
+ * Waits for the next completion entry and reaps it. The virtual clock is
+ * stepped meanwhile, for the timing model to let the job complete.
+ */
+static void reap(InferenceState *s, InferenceCompletion *cqe)
+{
+    uint64_t addr = s->cq + s->cq_head * sizeof(*cqe);
+    gint64 start_time = g_get_monotonic_time();
+
+    for (;;) {
+        qtest_memread(s->qs->qts, addr, cqe, sizeof(*cqe));
+        if ((le16_to_cpu(cqe->status) & CQE_PHASE) == s->phase) {
+            break;
+        }
+        qtest_clock_step(s->qs->qts, 10 * 1000);
+        g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+    }
+    cqe->id = le16_to_cpu(cqe->id);
+    cqe->status = le16_to_cpu(cqe->status);
+
+    s->cq_head = (s->cq_head + 1) % RING_SIZE;
+    if (s->cq_head == 0) {
+        s->phase ^= CQE_PHASE;
+    }
+    queue_writel(s, Q_CQ_HEAD, s->cq_head);
+}
+
+static void reap_expect(InferenceState *s, uint16_t id, uint16_t error)
+{
+    InferenceCompletion cqe;
+
+    reap(s, &cqe);
+    g_assert_cmpuint(cqe.id, ==, id);
+    g_assert_cmpuint(CQE_ERROR(cqe.status), ==, error);
+}
+
+static void test_queue(void)
+{
+    InferenceState s;
+    InferenceSubmission entry;
+    uint64_t in, out;
+
+    setup(&s);
+    in = buf_new(&s, BUF_SIZE, 1);
+    out = buf_new(&s, BUF_SIZE, 0x80);
+    g_assert_cmpuint(queue_readl(&s, Q_HEAD), ==, 0);
+
+    entry = job_entry(1, in, out, BUF_SIZE);
+    submit(&s, &entry);
+    reap_expect(&s, 1, ERROR_NONE);
+    buf_assert_equal(&s, in, out, BUF_SIZE);
+
+    g_assert_cmpuint(queue_readl(&s, Q_HEAD), ==, 1);
+    g_assert_cmpuint(queue_readl(&s, Q_STATUS), ==, 0);
+    cleanup(&s);
+}
+
+static void test_phase(void)
+{
+    InferenceState s;
+    uint64_t in, out;
+
+    setup(&s);
+    in = buf_new(&s, BUF_SIZE, 1);
+    out = guest_alloc(&s.qs->alloc, BUF_SIZE);
+
+    /* Past the end of both rings, entries of the second pass have phase 0 */
+    for (uint16_t id = 0; id < RING_SIZE + 1; id++) {
+        InferenceSubmission entry = job_entry(id, in, out, BUF_SIZE);
+
+        submit(&s, &entry);
+        reap_expect(&s, id, ERROR_NONE);
+        g_assert_cmpuint(queue_readl(&s, Q_HEAD), ==, (id + 1) % RING_SIZE);
+    }
+    g_assert_cmpuint(s.phase, ==, 0);
+    cleanup(&s);
+}
+
+static void test_errors(void)
+{
+    InferenceState s;
+    InferenceSubmission entry;
+    uint64_t in, out;
+
+    setup(&s);
+    in = buf_new(&s, BUF_SIZE, 1);
+    out = guest_alloc(&s.qs->alloc, BUF_SIZE);
+
+    entry = job_entry(1, in, out, 0);
+    submit(&s, &entry);
+    reap_expect(&s, 1, ERROR_LENGTH);
+    g_assert_cmpuint(STATUS_ERROR(queue_readl(&s, Q_STATUS)), ==,
+                     ERROR_LENGTH);
+
+    entry = job_entry(2, in, out, BUF_SIZE);
+    entry.model = cpu_to_le32(7);
+    submit(&s, &entry);
+    reap_expect(&s, 2, ERROR_MODEL);
+
+    /* The device only moves tensors to and from RAM, not its own BAR */
+    entry = job_entry(3, s.bar.addr, out, BUF_SIZE);
+    submit(&s, &entry);
+    reap_expect(&s, 3, ERROR_DMA);
+    g_assert_cmpuint(STATUS_ERROR(queue_readl(&s, Q_STATUS)), ==, ERROR_DMA);
+
+    /* A failed job does not stop the queue */
+    entry = job_entry(4, in, out, BUF_SIZE);
+    submit(&s, &entry);
+    reap_expect(&s, 4, ERROR_NONE);
+    buf_assert_equal(&s, in, out, BUF_SIZE);
+    cleanup(&s);
+}
+
+static void test_reset(void)
+{
+    InferenceState s;
+    InferenceSubmission entry;
+    uint64_t in, out;
+
+    setup(&s);
+    in = buf_new(&s, BUF_SIZE, 1);
+    out = guest_alloc(&s.qs->alloc, BUF_SIZE);
+
+    entry = job_entry(1, in, out, 0);
+    submit(&s, &entry);
+    reap_expect(&s, 1, ERROR_LENGTH);
+
+    qpci_io_writel(s.dev, s.bar, REG_CONTROL, CONTROL_RESET);
+    g_assert_cmpuint(queue_readl(&s, Q_SIZE), ==, 0);
+    g_assert_cmpuint(queue_readl(&s, Q_HEAD), ==, 0);
+    g_assert_cmpuint(queue_readl(&s, Q_CQ_SIZE), ==, 0);
+    g_assert_cmpuint(queue_readl(&s, Q_STATUS), ==, 0);
+
+    /* The completion ring starts over with phase 1 */
+    queue_setup(&s);
+    entry = job_entry(2, in, out, BUF_SIZE);
+    submit(&s, &entry);
+    reap_expect(&s, 2, ERROR_NONE);
+    g_assert_cmpuint(queue_readl(&s, Q_HEAD), ==, 1);
+    cleanup(&s);
+}
+
+static void test_batch(void)
+{
+    InferenceState s;
+    InferenceSubmission members[3], entry = { 0 };
+    uint64_t in[3], out[3], table;
+
+    setup(&s);
+    for (int i = 0; i < ARRAY_SIZE(members); i++) {
+        in[i] = buf_new(&s, BUF_SIZE, i * 0x10);
+        out[i] = guest_alloc(&s.qs->alloc, BUF_SIZE);
+        members[i] = job_entry(0x100 + i, in[i], out[i], BUF_SIZE);
+    }
+    table = guest_alloc(&s.qs->alloc, sizeof(members));
+    qtest_memwrite(s.qs->qts, table, members, sizeof(members));
+
+    /* One completion for the whole batch, with the id of its entry */
+    entry.id = cpu_to_le16(9);
+    entry.flags = cpu_to_le16(SUBMIT_F_BATCH);
+    entry.sg_table = cpu_to_le64(table);
+    entry.sg_count = cpu_to_le32(ARRAY_SIZE(members));
+    submit(&s, &entry);
+    reap_expect(&s, 9, ERROR_NONE);
+    for (int i = 0; i < ARRAY_SIZE(members); i++) {
+        buf_assert_equal(&s, in[i], out[i], BUF_SIZE);
+    }
+    g_assert_cmpuint(queue_readl(&s, Q_HEAD), ==, 1);
+
+    /* The batch carries the error of a member that failed */
+    members[1].src_len = 0;
+    qtest_memwrite(s.qs->qts, table, members, sizeof(members));
+    entry.id = cpu_to_le16(10);
+    submit(&s, &entry);
+    reap_expect(&s, 10, ERROR_LENGTH);
+    cleanup(&s);
+}
+
+static void test_load(void)
+{
+    InferenceState s;
+    InferenceSubmission load = { 0 }, entry;
+    uint64_t in, out, weights;
+
+    setup(&s);
+    in = buf_new(&s, BUF_SIZE, 1);
+    out = guest_alloc(&s.qs->alloc, BUF_SIZE);
+    weights = buf_new(&s, 4 * BUF_SIZE, 0x40);
+
+    entry = job_entry(1, in, out, BUF_SIZE);
+    entry.model = cpu_to_le32(3);
+    submit(&s, &entry);
+    reap_expect(&s, 1, ERROR_MODEL);
+
+    /* The job is queued along with the load, it runs once the model is in */
+    load.id = cpu_to_le16(2);
+    load.flags = cpu_to_le16(SUBMIT_F_LOAD);
+    load.model = cpu_to_le32(3);
+    load.src = cpu_to_le64(weights);
+    load.src_len = cpu_to_le32(4 * BUF_SIZE);
+    push(&s, &load);
+    entry.id = cpu_to_le16(3);
+    submit(&s, &entry);
+    reap_expect(&s, 2, ERROR_NONE);
+    reap_expect(&s, 3, ERROR_NONE);
+    buf_assert_equal(&s, in, out, BUF_SIZE);
+
+    /* A reset drops the resident models */
+    qpci_io_writel(s.dev, s.bar, REG_CONTROL, CONTROL_RESET);
+    queue_setup(&s);
+    entry.id = cpu_to_le16(4);
+    submit(&s, &entry);
+    reap_expect(&s, 4, ERROR_MODEL);
+    cleanup(&s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/pci-inference/queue", test_queue);
+    qtest_add_func("/pci-inference/phase", test_phase);
+    qtest_add_func("/pci-inference/errors", test_errors);
+    qtest_add_func("/pci-inference/reset", test_reset);
+    qtest_add_func("/pci-inference/batch", test_batch);
+    qtest_add_func("/pci-inference/load", test_load);
+
+    return g_test_run();
+}
@@ -0,0 +1,133 @@
+/*
+ * Tests of the CPU inference backend kernels
+ *
+ * Every vector kernel set the host can run is checked against the
+ * portable C one, on lengths that leave a scalar tail after the vectors.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "sysemu/inference-cpu.h"
+
+/* Around the 8 and 16 float vectors of AVX2 and AVX-512 */
+static const size_t lengths[] = {
+    1, 3, 7, 8, 9, 15, 16, 17, 31, 33, 63, 65, 127,
+};
+
+/* The vector exp() differs from the libm one in the last bits */
+#define TOLERANCE 1e-5
+
+static const InferenceCpuKernels *kernels_c;
+
+static void fill(float *x, size_t n, double range)
+{
+    for (size_t i = 0; i < n; i++) {
+        x[i] = g_test_rand_double_range(-range, range);
+    }
+}
+
+static void check_close(const float *got, const float *want, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        g_assert_cmpfloat_with_epsilon(got[i], want[i],
+                                       TOLERANCE * MAX(1.0, fabs(want[i])));
+    }
+}
+
+typedef void (*ElementwiseFn)(size_t n, const float *x, float *y);
+
+static void test_elementwise(ElementwiseFn (*get)(const InferenceCpuKernels *),
+                             double range)
+{
+    const InferenceCpuKernels *k;
+
+    for (unsigned i = 0; (k = inference_cpu_kernels(i)) != kernels_c; i++) {
+        for (size_t j = 0; j < ARRAY_SIZE(lengths); j++) {
+            size_t n = lengths[j];
+            g_autofree float *x = g_new(float, n);
+            g_autofree float *want = g_new(float, n);
+            /* One more element, which the kernel must not write */
+            g_autofree float *got = g_new(float, n + 1);
+
+            fill(x, n, range);
+            got[n] = 42.0f;
+            get(kernels_c)(n, x, want);
+            get(k)(n, x, got);
+            check_close(got, want, n);
+            g_assert_cmpfloat(got[n], ==, 42.0f);
+        }
+    }
+}
+
+static ElementwiseFn get_relu(const InferenceCpuKernels *k)
+{
+    return k->relu;
+}
+
+static ElementwiseFn get_gelu(const InferenceCpuKernels *k)
+{
+    return k->gelu;
+}
+
+static ElementwiseFn get_softmax(const InferenceCpuKernels *k)
+{
+    return k->softmax;
+}
+
+static void test_relu(void)
+{
+    test_elementwise(get_relu, 10.0);
+}
+
+static void test_gelu(void)
+{
+    test_elementwise(get_gelu, 10.0);
+}
+
+static void test_softmax(void)
+{
+    test_elementwise(get_softmax, 20.0);
+}
+
+static void test_gemm(void)
+{
+    static const size_t dims[][3] = {
+        { 1, 1, 1 }, { 3, 5, 7 }, { 2, 9, 17 }, { 5, 33, 15 }, { 4, 7, 65 },
+    };
+    const InferenceCpuKernels *k;
+
+    for (unsigned i = 0; (k = inference_cpu_kernels(i)) != kernels_c; i++) {
+        for (size_t j = 0; j < ARRAY_SIZE(dims); j++) {
+            size_t m = dims[j][0], kk = dims[j][1], n = dims[j][2];
+            g_autofree float *a = g_new(float, m * kk);
+            g_autofree float *b = g_new(float, kk * n);
+            g_autofree float *want = g_new(float, m * n);
+            g_autofree float *got = g_new(float, m * n);
+
+            fill(a, m * kk, 1.0);
+            fill(b, kk * n, 1.0);
+            kernels_c->gemm(m, kk, n, a, b, want);
+            k->gemm(m, kk, n, a, b, got);
+            check_close(got, want, m * n);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    /* The C set comes last */
+    for (unsigned i = 0; inference_cpu_kernels(i); i++) {
+        kernels_c = inference_cpu_kernels(i);
+    }
+    g_assert_cmpstr(kernels_c->name, ==, "c");
+
+    g_test_add_func("/inference-cpu/relu", test_relu);
+    g_test_add_func("/inference-cpu/gelu", test_gelu);
+    g_test_add_func("/inference-cpu/softmax", test_softmax);
+    g_test_add_func("/inference-cpu/gemm", test_gemm);
+    return g_test_run();
+}
@@ -0,0 +1,135 @@
+/*
+ * Tests of the lock-free pointer ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/ptr-ring.h"
+
+#define N_PRODUCERS 4
+#define N_CONSUMERS 4
+#define N_ENTRIES 10000
+#define RING_SIZE 64
+
+/* Entries encode the producer in their low bits, so that 0 is never pushed */
+#define PRODUCER_BITS 4
+
+static PtrRingMP ring;
+static unsigned popped_total;
+/* How many times every entry of every producer was popped */
+static unsigned seen[N_PRODUCERS][N_ENTRIES];
+
+static void test_fifo(void)
+{
+    uintptr_t i;
+
+    ptr_ring_mp_init(&ring, 5);
+    g_assert(ptr_ring_mp_empty(&ring));
+    g_assert_null(ptr_ring_mp_pop(&ring));
+
+    /* Rounded up to 8 entries, several laps so that the slots wrap */
+    for (unsigned lap = 0; lap < 3; lap++) {
+        for (i = 1; i <= 8; i++) {
+            g_assert(ptr_ring_mp_push(&ring, (void *)i));
+        }
+        g_assert_false(ptr_ring_mp_push(&ring, (void *)i));
+        g_assert_false(ptr_ring_mp_empty(&ring));
+
+        for (i = 1; i <= 8; i++) {
+            g_assert_cmpuint((uintptr_t)ptr_ring_mp_pop(&ring), ==, i);
+        }
+        g_assert_null(ptr_ring_mp_pop(&ring));
+        g_assert(ptr_ring_mp_empty(&ring));
+    }
+
+    ptr_ring_mp_destroy(&ring);
+}
+
+static void *producer_func(void *arg)
+{
+    uintptr_t id = (uintptr_t)arg;
+
+    for (uintptr_t seq = 0; seq < N_ENTRIES; seq++) {
+        while (!ptr_ring_mp_push(&ring, (void *)((seq << PRODUCER_BITS) |
+                                                 (id + 1)))) {
+            g_thread_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_func(void *arg)
+{
+    /* The entries of one producer reach each consumer in push order */
+    long last[N_PRODUCERS];
+
+    for (int i = 0; i < N_PRODUCERS; i++) {
+        last[i] = -1;
+    }
+
+    while (qatomic_read(&popped_total) < N_PRODUCERS * N_ENTRIES) {
+        uintptr_t val = (uintptr_t)ptr_ring_mp_pop(&ring);
+        unsigned id;
+        long seq;
+
+        if (!val) {
+            g_thread_yield();
+            continue;
+        }
+
+        id = (val & ((1 << PRODUCER_BITS) - 1)) - 1;
+        seq = val >> PRODUCER_BITS;
+        g_assert_cmpuint(id, <, N_PRODUCERS);
+        g_assert_cmpint(seq, <, N_ENTRIES);
+        g_assert_cmpint(seq, >, last[id]);
+        last[id] = seq;
+
+        qatomic_inc(&seen[id][seq]);
+        qatomic_inc(&popped_total);
+    }
+    return NULL;
+}
+
+/* Several producers and consumers, every entry comes out exactly once */
+static void test_mpmc(void)
+{
+    QemuThread producers[N_PRODUCERS], consumers[N_CONSUMERS];
+
+    ptr_ring_mp_init(&ring, RING_SIZE);
+
+    for (uintptr_t i = 0; i < N_CONSUMERS; i++) {
+        qemu_thread_create(&consumers[i], "consumer", consumer_func, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (uintptr_t i = 0; i < N_PRODUCERS; i++) {
+        qemu_thread_create(&producers[i], "producer", producer_func,
+                           (void *)i, QEMU_THREAD_JOINABLE);
+    }
+
+    for (int i = 0; i < N_PRODUCERS; i++) {
+        qemu_thread_join(&producers[i]);
+    }
+    for (int i = 0; i < N_CONSUMERS; i++) {
+        qemu_thread_join(&consumers[i]);
+    }
+
+    for (int i = 0; i < N_PRODUCERS; i++) {
+        for (int j = 0; j < N_ENTRIES; j++) {
+            g_assert_cmpuint(seen[i][j], ==, 1);
+        }
+    }
+    g_assert(ptr_ring_mp_empty(&ring));
+
+    ptr_ring_mp_destroy(&ring);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/ptr-ring/mp/fifo", test_fifo);
+    g_test_add_func("/ptr-ring/mp/mpmc", test_mpmc);
+    return g_test_run();
+}
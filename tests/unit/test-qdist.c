@@ -348,6 +348,36 @@ static void test_single_empty(void)
     qdist_destroy(&dist);
 }
 
+static void test_percentile(void)
+{
+    struct qdist dist;
+    int i;
+
+    qdist_init(&dist);
+
+    g_assert(isnan(qdist_percentile(&dist, 50)));
+
+    /* inserted out of order, with an empty entry in the middle */
+    for (i = 1000; i > 0; i--) {
+        qdist_inc(&dist, i);
+    }
+    qdist_add(&dist, 500.5, 0);
+
+    g_assert_cmpfloat(qdist_percentile(&dist, 0), ==, 1);
+    g_assert_cmpfloat(qdist_percentile(&dist, 50), ==, 500);
+    g_assert_cmpfloat(qdist_percentile(&dist, 99), ==, 990);
+    g_assert_cmpfloat(qdist_percentile(&dist, 99.9), ==, 999);
+    g_assert_cmpfloat(qdist_percentile(&dist, 100), ==, 1000);
+
+    /* a single heavy entry holds the whole tail */
+    qdist_add(&dist, 5000, 9000);
+    g_assert_cmpfloat(qdist_percentile(&dist, 10), ==, 1000);
+    g_assert_cmpfloat(qdist_percentile(&dist, 50), ==, 5000);
+    g_assert_cmpfloat(qdist_percentile(&dist, 99.9), ==, 5000);
+
+    qdist_destroy(&dist);
+}
+
 static void test_none(void)
 {
     struct qdist dist;
@@ -385,5 +415,6 @@ int main(int argc, char *argv[])
     g_test_add_func("/qdist/binning/expand", test_bin_expand);
     g_test_add_func("/qdist/binning/shrink", test_bin_shrink);
     g_test_add_func("/qdist/pr", test_pr);
+    g_test_add_func("/qdist/percentile", test_percentile);
     return g_test_run();
 }
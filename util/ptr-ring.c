@@ -0,0 +1,31 @@
+/*
+ * Lock-free bounded ring of pointers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/ptr-ring.h"
+
+void ptr_ring_mp_init(PtrRingMP *ring, unsigned long size)
+{
+    size = pow2ceil(MAX(size, 1));
+
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = g_new(PtrRingMPSlot, size);
+    ring->mask = size - 1;
+
+    /* Slot i is free for the producer that claims index i */
+    for (unsigned long i = 0; i < size; i++) {
+        ring->slots[i].seq = i;
+        ring->slots[i].ptr = NULL;
+    }
+}
+
+void ptr_ring_mp_destroy(PtrRingMP *ring)
+{
+    g_free(ring->slots);
+    ring->slots = NULL;
+}
@@ -395,3 +395,26 @@ double qdist_avg(const struct qdist *dist)
     }
     return qdist_pairwise_avg(dist, 0, dist->n, count);
 }
+
+/*
+ * Return the smallest x such that at least @percent % of the samples
+ * are <= x; i.e. the nearest-rank percentile.
+ */
+double qdist_percentile(const struct qdist *dist, double percent)
+{
+    unsigned long count, rank, seen = 0;
+    size_t i;
+
+    count = qdist_sample_count(dist);
+    if (!count) {
+        return NAN;
+    }
+    rank = MAX(ceil(count * percent / 100.0), 1);
+    for (i = 0; i < dist->n; i++) {
+        seen += dist->entries[i].count;
+        if (seen >= rank) {
+            return dist->entries[i].x;
+        }
+    }
+    return dist->entries[dist->n - 1].x;
+}